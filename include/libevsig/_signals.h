@@ -2,35 +2,86 @@
 #include <threads.h>
 #include "unwind.h"
 #include "stdlib.h"
+#include <errno.h>
 
 typedef struct {
   const char* sig_type;
   sig_handler handler;
   void*       handler_userdata;
+  sig_dispatch_policy* policy;
+  bool        pure;
   uint64_t    id;
+
+  // Set for SIG_AUTOPOP_HANDLER_TABLE entries, which have no sig_type or
+  // handler of their own
+  const sig_clause* clauses;
+  uint64_t          nclauses;
 } sig_handler_stack_entry;
 
+typedef struct sig_resume_frame sig_resume_frame;
+typedef struct sig_args_frame   sig_args_frame;
+
 typedef struct {
   const char* sig_type;
   const char* restart_type;
   unwind_return_point* p;
   uint64_t id;
+
+  // sig_resume_top and the args frame when the restart was established,
+  // restored when it runs
+  sig_resume_frame* resume_top;
+  sig_args_frame*   args_top;
 } sig_restart_stack_entry;
 
+// The resumable send in progress, if any. Lives on _sig_send_resumable's stack.
+struct sig_resume_frame {
+  const char*       sig_type;
+  intptr_t          value;
+  sig_resume_state* state;
+};
+
+extern thread_local sig_resume_frame* sig_resume_top;
+
 extern thread_local sig_handler_stack_entry* sig_handler_stack;
 extern thread_local int64_t sig_handler_stack_alloc;
 extern thread_local int64_t sig_handler_stack_fill;
+extern thread_local uint64_t sig_handler_stack_generation;
 
 extern thread_local sig_restart_stack_entry* sig_restart_stack;
 extern thread_local int64_t sig_restart_stack_alloc;
 extern thread_local int64_t sig_restart_stack_fill;
 
-void _sig_send(const char* sig_type,
+// Identifies a send site for dispatch policies' dedup: unique per macro
+// expansion (per line, strictly). Code that sends on behalf of its caller,
+// like the sigwrap wrappers, defines it as __builtin_return_address(0) before
+// including this header.
+#define _SIG_STR2(x) #x
+#define _SIG_STR(x) _SIG_STR2(x)
+#ifndef _SIG_SITE
+#define _SIG_SITE() ((const void*)(__FILE__ ":" _SIG_STR(__LINE__)))
+#endif
+
+void _sig_send(const void* site,
+               const char* sig_type,
                const char* msg,
                void* signal_data,
                sig_cleanup_func signal_data_cleanup_func);
 
+const char* _sig_send_resumable(sig_resume_state* state,
+                                const void* site,
+                                const char* sig_type,
+                                const char* msg,
+                                void* signal_data,
+                                sig_cleanup_func signal_data_cleanup_func,
+                                intptr_t* value_out);
+
 const uint64_t _sig_push_handler(const char* sig_type, sig_handler handler, void* userdata);
+const uint64_t _sig_push_handler_table(const sig_clause* clauses, uint64_t nclauses);
+const uint64_t _sig_push_pure_handler(const char* sig_type, sig_handler handler, void* userdata);
+const uint64_t _sig_push_handler_policy(const char* sig_type,
+                                        sig_handler handler,
+                                        void* userdata,
+                                        sig_dispatch_policy* policy);
 void           _sig_rm_handler (uint64_t id);
 void           _sig_assert_handler(const char* sig_type);
 void           _sig_assertwarn_handler(const char* sig_type);
@@ -39,25 +90,82 @@ void           _sig_rm_restart(uint64_t id);
 bool           _sig_restart_available(const char* sig_type, const char* restart_type);
 void           _unwind_handler_sig_rm_handler(void* id);
 void           _unwind_handler_sig_rm_restart(void* id);
+void           _unwind_value_handler_sig_rm_handler(unwind_value id);
+void           _unwind_value_handler_sig_rm_restart(unwind_value id);
 
 #define _SIG_SEND(sig_type, msg, signal_data, signal_data_cleanup_func, gensym) \
-  _sig_send(sig_type, msg, signal_data, signal_data_cleanup_func);
+  _sig_send(_SIG_SITE(), sig_type, msg, signal_data, signal_data_cleanup_func);
+
+#define _SIG_RESUMABLE(result, call, failed, sig_type, msg, gensymr, gensymv, gensyms) \
+  { \
+    sig_resume_state gensyms = {0}; \
+    while (true) { \
+      result = (call); \
+      if (!(failed)) break; \
+      intptr_t gensymv = 0; \
+      const char* gensymr = \
+        _sig_send_resumable(&gensyms, _SIG_SITE(), sig_type, msg, NULL, NULL, &gensymv); \
+      if (gensymr == SIG_RESTART_RETRY) continue; \
+      if (gensymr == SIG_RESTART_USE_VALUE) result = (typeof(result))gensymv; \
+      break; \
+    } \
+  }
+
+#define _SIG_RESUMABLE_EINTR(result, call, failed, sig_type, msg, gensymr, gensymv, gensyms) \
+  { \
+    sig_resume_state gensyms = {0}; \
+    while (true) { \
+      result = (call); \
+      if (!(failed)) break; \
+      if (errno == EINTR) { SIG_CHECKPOINT(); continue; } \
+      intptr_t gensymv = 0; \
+      const char* gensymr = \
+        _sig_send_resumable(&gensyms, _SIG_SITE(), sig_type, msg, NULL, NULL, &gensymv); \
+      if (gensymr == SIG_RESTART_RETRY) continue; \
+      if (gensymr == SIG_RESTART_USE_VALUE) result = (typeof(result))gensymv; \
+      break; \
+    } \
+  }
 
 #define _SIG_AUTOPOP_HANDLER(sig_type, handler, userdata, gensym) \
   uint64_t gensym = _sig_push_handler(sig_type, handler, userdata); \
-  UNWIND_ACTION(_unwind_handler_sig_rm_handler, &gensym);
+  UNWIND_VALUE_ACTION(_unwind_value_handler_sig_rm_handler, gensym);
+
+#define _SIG_AUTOPOP_PURE_HANDLER(sig_type, handler, userdata, gensym) \
+  uint64_t gensym = _sig_push_pure_handler(sig_type, handler, userdata); \
+  UNWIND_VALUE_ACTION(_unwind_value_handler_sig_rm_handler, gensym);
+
+#define _SIG_AUTOPOP_HANDLER_TABLE(gensym, gensymt, ...) \
+  static const sig_clause gensymt[] = { __VA_ARGS__ }; \
+  uint64_t gensym = _sig_push_handler_table(gensymt, sizeof(gensymt)/sizeof(sig_clause)); \
+  UNWIND_VALUE_ACTION(_unwind_value_handler_sig_rm_handler, gensym);
 
+#define _SIG_AUTOPOP_HANDLER_POLICY(sig_type, handler, userdata, policy, gensym) \
+  uint64_t gensym = _sig_push_handler_policy(sig_type, handler, userdata, policy); \
+  UNWIND_VALUE_ACTION(_unwind_value_handler_sig_rm_handler, gensym);
 
 #define _SIG_PROVIDE_RESTART(sig_type, might_signal_code, restart_type, restart_action, gensym, gensymb) \
-  uint64_t gensymb; \
   UNWIND_RETURN_POINT(gensym, { \
-    gensymb = _sig_push_restart(sig_type, restart_type, &gensym); \
-    UNWIND_ACTION(_unwind_handler_sig_rm_restart, &gensymb); \
+    uint64_t gensymb = _sig_push_restart(sig_type, restart_type, &gensym); \
+    UNWIND_VALUE_ACTION(_unwind_value_handler_sig_rm_restart, gensymb); \
     might_signal_code; \
   }, restart_action);
 
 #define _SIG_PROVIDE_AUTOPOP_RESTART(sig_type, restart_type, restart_action, gensym, gensymb) \
-  uint64_t gensymb; \
   UNWIND_AUTOPOP_RETURN_POINT(gensym, restart_action); \
-  gensymb = _sig_push_restart(sig_type, restart_type, &gensym); \
-  UNWIND_ACTION(_unwind_handler_sig_rm_restart, &gensymb);
+  uint64_t gensymb = _sig_push_restart(sig_type, restart_type, &gensym); \
+  UNWIND_VALUE_ACTION(_unwind_value_handler_sig_rm_restart, gensymb);
+
+#define _SIG_RESTART_ARGS(args_type, args_name, gensym) \
+  _Static_assert(sizeof(args_type) <= UNWIND_RETURN_POINT_ARGS_MAX, \
+                "restart args larger than UNWIND_RETURN_POINT_ARGS_MAX"); \
+  args_type args_name; \
+  __builtin_memcpy(&args_name, gensym.args, sizeof(args_type));
+
+#define _SIG_PROVIDE_RESTART_ARGS(sig_type, might_signal_code, restart_type, args_type, args_name, restart_action, gensym, gensymb) \
+  _SIG_PROVIDE_RESTART(sig_type, might_signal_code, restart_type, \
+    { _SIG_RESTART_ARGS(args_type, args_name, gensym); restart_action; }, gensym, gensymb)
+
+#define _SIG_PROVIDE_AUTOPOP_RESTART_ARGS(sig_type, restart_type, args_type, args_name, restart_action, gensym, gensymb) \
+  _SIG_PROVIDE_AUTOPOP_RESTART(sig_type, restart_type, \
+    { _SIG_RESTART_ARGS(args_type, args_name, gensym); restart_action; }, gensym, gensymb)
@@ -0,0 +1,76 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <threads.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sampling allocation profiler for sw_malloc, sw_calloc and sw_realloc.
+//
+// Allocations are sampled by bytes with a Poisson process: on average one
+// sample per sample_interval bytes, so big allocations are more likely to
+// be sampled than small ones, and each sample is weighted to give unbiased
+// estimates. A sample records the call stack, and counts toward total and
+// (until freed with sw_free) live bytes for that stack.
+//
+// Between samples an allocation costs one thread_local subtract and compare,
+// and threads aggregate into their own tables without locks, so it's cheap
+// enough to leave running in production.
+//
+//   evsig_alloc_profile_start(0);
+//   ...
+//   FILE* f = fopen("heap.prof", "w");
+//   evsig_alloc_profile_dump(f, EVSIG_ALLOC_PROFILE_PPROF);
+//
+//   $ pprof -top ./server heap.prof          # live bytes
+//   $ pprof -sample_index=alloc_space ...    # total bytes
+//
+// Only memory freed with sw_free (or unwind_handler_free and friends) is
+// removed from live bytes, or once malloc reuses its address for another
+// sampled allocation.
+
+#define EVSIG_ALLOC_PROFILE_DEFAULT_INTERVAL (512*1024)
+#define EVSIG_ALLOC_PROFILE_MAX_DEPTH 32
+
+// Distinct stacks per thread, and sampled allocations alive at once
+#define EVSIG_ALLOC_PROFILE_BUCKETS 1024
+#define EVSIG_ALLOC_PROFILE_LIVE_SLOTS 65536
+
+typedef enum {
+  // Legacy pprof heap profile (heap_v2), with MAPPED_LIBRARIES
+  EVSIG_ALLOC_PROFILE_PPROF,
+
+  // Stacks sorted by total bytes, with symbols where available
+  EVSIG_ALLOC_PROFILE_TEXT,
+} evsig_alloc_profile_format;
+
+// sample_interval 0 means EVSIG_ALLOC_PROFILE_DEFAULT_INTERVAL. Calling it
+// again changes the interval and keeps what was recorded.
+void evsig_alloc_profile_start(uint64_t sample_interval);
+void evsig_alloc_profile_stop();
+
+// Safe to call while other threads allocate. Counts being updated during the
+// dump may be slightly off.
+void evsig_alloc_profile_dump(FILE* f, evsig_alloc_profile_format format);
+
+// Implementation details
+
+// Bytes left until the next sample
+extern thread_local int64_t _evsig_alloc_profile_countdown;
+
+void _evsig_alloc_profile_sample(void* ptr, size_t size);
+// Takes the address only, as sw_realloc calls it once ptr was freed
+void _evsig_alloc_profile_free(uintptr_t ptr);
+
+#define _EVSIG_ALLOC_PROFILE(ptr, size) \
+  { \
+    if (__builtin_expect((_evsig_alloc_profile_countdown -= (int64_t)(size)) < 0, 0) && (ptr)) \
+      _evsig_alloc_profile_sample(ptr, size); \
+  }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "libevsig/unwind.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bump allocator for memory that lives as long as a scope, such as a
+// request. Allocating is a pointer bump, and everything is released at once
+// by a single unwind action, whether the scope exits normally or unwinds.
+// Replaces pairing each sw_malloc with UNWIND_ACTION(unwind_handler_free, ...).
+//
+//   EVSIG_ARENA_SCOPE(req, 0);
+//   char* buf = evsig_arena_alloc(&req, 4096);
+//   conn_state* c = evsig_arena_alloc(&req, sizeof(conn_state));
+//
+// Memory comes in chunks. Released chunks of the default size are kept in a
+// small per-thread cache, so the next request on the thread reuses warm
+// memory. Running out of memory sends SIGNAL_ALLOC_FAILED as sw_malloc does.
+//
+// An arena belongs to one thread.
+
+#define EVSIG_ARENA_DEFAULT_CHUNK_SIZE (64*1024)
+
+// Chunks kept per thread for reuse
+#define EVSIG_ARENA_CACHE_MAX_CHUNKS 16
+
+typedef struct evsig_arena_chunk {
+  struct evsig_arena_chunk* next;
+  uint64_t size; // Usable bytes in data
+  _Alignas(16) unsigned char data[];
+} evsig_arena_chunk;
+
+typedef struct {
+  evsig_arena_chunk* chunks; // Current chunk first
+  unsigned char*     cur;
+  unsigned char*     end;
+  uint64_t           chunk_size;
+} evsig_arena;
+
+// chunk_size is the usable size of each chunk. 0 means
+// EVSIG_ARENA_DEFAULT_CHUNK_SIZE, which is also the only size that is cached.
+void evsig_arena_init(evsig_arena* a, uint64_t chunk_size);
+
+// Returns 16-byte aligned memory, or NULL if allocation failed and a handler
+// let that continue. Allocations bigger than a quarter of the chunk size get
+// a chunk of their own.
+void* evsig_arena_alloc(evsig_arena* a, uint64_t size);
+
+// align must be a power of two
+void* evsig_arena_alloc_aligned(evsig_arena* a, uint64_t size, uint64_t align);
+
+// Releases everything allocated from the arena. The arena can be used again
+// afterwards.
+void evsig_arena_release(evsig_arena* a);
+
+// Frees the calling thread's chunk cache. Happens on thread exit.
+void evsig_arena_cache_trim();
+
+void _unwind_handler_arena_release(void* arena);
+
+// Declares an arena named name released at end of scope or on unwind
+#define EVSIG_ARENA_SCOPE(name, chunk_size) \
+  evsig_arena name; \
+  evsig_arena_init(&name, chunk_size); \
+  UNWIND_ACTION_CLASS(UNWIND_CLASS_MEMORY, _unwind_handler_arena_release, &name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+#include <stdint.h>
+#include "libevsig/signals.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Large anonymous buffers backed by huge pages where possible, for multi-GB
+// I/O buffers where TLB misses add up.
+//
+// Tries, in order:
+//
+//   1. Explicit huge pages (MAP_HUGETLB), which need pages reserved in
+//      /proc/sys/vm/nr_hugepages
+//   2. Transparent huge pages: a mapping aligned to the huge page size with
+//      madvise(MADV_HUGEPAGE)
+//   3. Normal pages
+//
+// Each fallback sends a distinct resumable signal, but only if this thread
+// has a handler for it, so by default falling back is silent. Handlers can
+// log and select SIG_RESTART_CONTINUE to fall back, select
+// SIG_RESTART_BIGBUF_REJECT to make evsig_bigbuf_alloc return NULL, or
+// select an ordinary restart to unwind.
+//
+//   EVSIG_BIGBUF_SCOPE(buf, 4ull << 30, EVSIG_BIGBUF_POPULATE);
+//   read_into(buf.data, buf.size);
+//
+// Buffers smaller than a huge page get normal pages without any signals.
+
+SIG_DECLTYPE(SIGNAL_BIGBUF_NO_HUGETLB); // Falling back to transparent huge pages
+SIG_DECLTYPE(SIGNAL_BIGBUF_NO_THP);     // Falling back to normal pages
+SIG_DECLTYPE(SIG_RESTART_BIGBUF_REJECT);
+
+// Pre-fault the whole buffer at allocation, so first use doesn't page fault
+#define EVSIG_BIGBUF_POPULATE (1 << 0)
+
+typedef enum {
+  EVSIG_BIGBUF_NONE,
+  EVSIG_BIGBUF_HUGETLB,
+  EVSIG_BIGBUF_THP,
+  EVSIG_BIGBUF_PAGES,
+} evsig_bigbuf_backing;
+
+typedef struct {
+  void*    data;     // NULL if the allocation was rejected
+  uint64_t size;     // As requested
+  uint64_t map_size; // Rounded up to the page size of the backing
+  evsig_bigbuf_backing backing;
+} evsig_bigbuf;
+
+// Returns b->data. NULL only if a handler rejected the allocation, or the
+// final mmap failed and its SIGNAL_ENOMEM handler continued.
+void* evsig_bigbuf_alloc(evsig_bigbuf* b, uint64_t size, uint32_t flags);
+
+// NULL-safe, and safe to call twice
+void evsig_bigbuf_free(evsig_bigbuf* b);
+
+// Default huge page size, from /proc/meminfo
+uint64_t evsig_huge_page_size();
+
+void _unwind_handler_bigbuf_free(void* b);
+
+// Declares a buffer named name freed at end of scope or on unwind
+#define EVSIG_BIGBUF_SCOPE(name, size, flags) \
+  evsig_bigbuf name; \
+  evsig_bigbuf_alloc(&name, size, flags); \
+  UNWIND_ACTION_CLASS(UNWIND_CLASS_MEMORY, _unwind_handler_bigbuf_free, &name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,159 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "libevsig/signals.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Recovery from allocation failure.
+//
+// Caches register reclaimers, which free memory on demand. When sw_malloc,
+// sw_calloc or sw_realloc fail, they send SIGNAL_ALLOC_FAILED (signal_data
+// is a size_t* with the requested size) and offer SIG_RESTART_RECLAIM_RETRY
+// in place: the reclaimers are run until enough is freed, then the allocation
+// is retried. If the reclaimers free nothing, SIGNAL_ALLOC_FAILED is sent
+// again without the restart, so other handlers (or the catch-all) decide,
+// and selecting it repeatedly can't loop.
+//
+//   uint64_t shrink_cache(uint64_t want, void* cache) { return cache_evict(cache, want); }
+//
+//   evsig_reclaimer_register(shrink_cache, &cache, 10);
+//   SIG_PERSISTENT_HANDLER(SIGNAL_ALLOC_FAILED, sig_reclaim_handler, NULL);
+//
+// So caches can grow into available memory and shrink under pressure,
+// instead of being kept small to stay far from OOM.
+//
+// An emergency reserve is held back (EVSIG_MEMORY_DEFAULT_RESERVE from the
+// first sig_init, see evsig_memory_reserve) and freed before
+// SIGNAL_ALLOC_FAILED is sent, so the signal machinery, handlers and
+// reclaimers have room to work. It's set aside again by the next allocation
+// that succeeds outside a SIGNAL_ALLOC_FAILED handler, on any thread.
+
+SIG_DECLTYPE(SIG_RESTART_RECLAIM_RETRY);
+SIG_DECLTYPE(SIGNAL_MEMORY_BUDGET_EXCEEDED);
+
+#define EVSIG_RECLAIMERS_MAX 64
+#define EVSIG_MEMORY_DEFAULT_RESERVE (256*1024)
+
+// Frees up to about want bytes, and returns how many bytes it freed. Called
+// from whichever thread's allocation failed, possibly from several at once.
+typedef uint64_t (*evsig_reclaimer)(uint64_t want, void* userdata);
+
+// Reclaimers with lower priority values run first, so register cheap to
+// rebuild caches low. Returns an id for evsig_reclaimer_unregister.
+//
+// Once unregister returns, no thread is still calling the reclaimer and its
+// userdata may be freed. Called from a reclaimer, it doesn't wait.
+uint64_t evsig_reclaimer_register(evsig_reclaimer fn, void* userdata, int32_t priority);
+void     evsig_reclaimer_unregister(uint64_t id);
+
+// Runs reclaimers in priority order until want bytes are freed. Returns the
+// bytes freed. Reclaimers that allocate and fail don't recurse into this.
+uint64_t evsig_reclaim(uint64_t want);
+
+// Sets the emergency reserve to bytes (0 disables), replacing the default.
+void evsig_memory_reserve(uint64_t bytes);
+
+// Handler for SIGNAL_ALLOC_FAILED that selects SIG_RESTART_RECLAIM_RETRY
+// where the sender offers it
+const char* sig_reclaim_handler(const char* sig_type, void* userdata, const char* msg, void* signal_data);
+
+// Memory budgets.
+//
+// SIG_MEMORY_BUDGET(bytes) limits how much the rest of the scope may allocate
+// through sw_malloc, sw_calloc and sw_realloc on this thread (realloc counts
+// growth, allocations that fail don't count). An allocation that would go
+// over sends SIGNAL_MEMORY_BUDGET_EXCEEDED before allocating, with the
+// exceeded sig_memory_budget as signal_data, so a handler selecting an
+// ordinary restart unwinds the request and frees what it allocated:
+//
+//   SIG_DEFTYPE(SIG_RESTART_REJECT); // Your own restart type, at file scope
+//
+//   SIG_AUTOPOP_RESTART(SIGNAL_MEMORY_BUDGET_EXCEEDED, SIG_RESTART_REJECT, {
+//     respond_413(conn);
+//     return;
+//   });
+//   SIG_AUTOPOP_HANDLER_TABLE(
+//     SIG_RESTART_CASE(SIGNAL_MEMORY_BUDGET_EXCEEDED, SIG_RESTART_REJECT));
+//   SIG_MEMORY_BUDGET(64 << 20);
+//   handle_request(conn);
+//
+// Handlers can also resume in place: SIG_RESTART_CONTINUE allows the
+// allocation and stops enforcing the exceeded scopes, SIG_RESTART_USE_VALUE
+// returns a value from the allocator, and SIG_RESTART_RETRY checks again
+// (e.g. after raising bytes).
+//
+// Scopes nest, the tightest one applies. Accounting is a thread_local add and
+// compare, so it's always on.
+
+typedef struct sig_memory_budget {
+  uint64_t bytes; // May be changed by handlers
+  uint64_t start; // evsig_memory_allocated when the scope began
+  bool     waived;
+  struct sig_memory_budget* prev;
+} sig_memory_budget;
+
+// Bytes allocated through the sigwrap allocators by this thread, ever
+extern thread_local uint64_t evsig_memory_allocated;
+
+// evsig_memory_allocated may go up to this before the innermost budget is
+// exceeded
+extern thread_local uint64_t evsig_memory_limit;
+
+extern thread_local sig_memory_budget* sig_memory_budget_top;
+
+#define SIG_MEMORY_BUDGET(bytes) \
+  _SIG_MEMORY_BUDGET(bytes, GENSYM(membudget))
+
+// Bytes the innermost scope has allocated so far
+uint64_t sig_memory_budget_used(const sig_memory_budget* b);
+
+void _sig_memory_budget_push(sig_memory_budget* b, uint64_t bytes);
+void _unwind_handler_sig_memory_budget_pop(void* b);
+
+#define _SIG_MEMORY_BUDGET(bytes, gensym) \
+  sig_memory_budget gensym; \
+  _sig_memory_budget_push(&gensym, bytes); \
+  UNWIND_ACTION(_unwind_handler_sig_memory_budget_pop, &gensym);
+
+// Charges size against the budget. Returns false if the allocation shouldn't
+// happen, with the allocator's return value in *value_out.
+bool _evsig_budget_exceeded(const void* site, size_t size, intptr_t* value_out);
+
+// Gives back a charge for an allocation that then failed
+void _evsig_budget_refund(size_t size);
+
+#define _EVSIG_BUDGET_CHARGE(size, value_out) \
+  (__builtin_expect((uint64_t)(size) <= evsig_memory_limit - evsig_memory_allocated, 1) \
+   ? (evsig_memory_allocated += (size), true) \
+   : _evsig_budget_exceeded(_SIG_SITE(), size, value_out))
+
+void _evsig_memory_init();
+bool _evsig_alloc_failed(sig_resume_state* state, const void* site, size_t size,
+                         intptr_t* value_out);
+void _evsig_alloc_recovered();
+
+extern _Atomic bool _evsig_reserve_spent;
+
+// Like SIG_RESUMABLE for allocators that return NULL on failure, also
+// offering SIG_RESTART_RECLAIM_RETRY
+#define _EVSIG_ALLOC_RESUMABLE(result, call, size, gensyms) \
+  { \
+    sig_resume_state gensyms = { .extra_restart = SIG_RESTART_RECLAIM_RETRY }; \
+    while (!(result = (call)) && _evsig_alloc_failed(&gensyms, _SIG_SITE(), size, (intptr_t*)&result)); \
+    if (result && (gensyms.attempt || \
+                   atomic_load_explicit(&_evsig_reserve_spent, memory_order_relaxed))) \
+      _evsig_alloc_recovered(); \
+  }
+
+#define EVSIG_ALLOC_RESUMABLE(result, call, size) \
+  _EVSIG_ALLOC_RESUMABLE(result, call, size, GENSYM(allocress))
+
+#ifdef __cplusplus
+}
+#endif
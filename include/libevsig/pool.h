@@ -0,0 +1,113 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "libevsig/signals.h"
+#include "libevsig/evsig_mutex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fixed-size object pool, for objects such as connections and buffers that
+// churn constantly.
+//
+// Each thread keeps a small cache of free objects per pool, so alloc and free
+// are usually a few instructions with no atomics. Objects can be freed from
+// any thread: frees go to the freeing thread's cache, and overflow goes to a
+// lock-free global list that other threads take from in one exchange.
+//
+// When a pool is at max_objects, allocating sends SIGNAL_POOL_EXHAUSTED as a
+// resumable signal. Handlers can select:
+//
+//   SIG_RESTART_POOL_GROW - Allow one more slab past the cap
+//   SIG_RESTART_RETRY     - Try again, e.g. after freeing something
+//   SIG_RESTART_CONTINUE  - Reject: evsig_pool_alloc returns NULL
+//
+// which gives admission control at the point memory runs short.
+//
+//   static evsig_pool conns;
+//   evsig_pool_init(&conns, sizeof(conn), 10000, false);
+//
+//   conn* c = EVSIG_POOL_ALLOC(&conns, conn);
+//   UNWIND_POOL_FREE(&conns, c); // Returned at end of scope or on unwind
+
+SIG_DECLTYPE(SIGNAL_POOL_EXHAUSTED);
+SIG_DECLTYPE(SIG_RESTART_POOL_GROW);
+
+#define EVSIG_POOL_SLAB_SIZE (64*1024)
+
+// Free objects a thread keeps per pool before returning some to the global
+// list
+#define EVSIG_POOL_CACHE_MAX 128
+
+// Pools a thread caches at once. Past this, the least recently added is
+// flushed.
+#define EVSIG_POOL_THREAD_CACHES 8
+
+typedef struct evsig_pool_node {
+  struct evsig_pool_node* next;
+} evsig_pool_node;
+
+typedef struct evsig_pool_slab {
+  struct evsig_pool_slab* next;
+  uint64_t size;
+} evsig_pool_slab;
+
+typedef struct {
+  uint64_t obj_size;      // Rounded up to 16
+  uint64_t objs_per_slab;
+  bool     numa_local;
+
+  // Objects carved from slabs so far, and the cap on that. 0 means no cap.
+  _Atomic uint64_t carved;
+  _Atomic uint64_t max_objects;
+
+  // Free objects not in any thread's cache
+  _Atomic(evsig_pool_node*) global_free;
+
+  evsig_mutex      slab_mutex;
+  evsig_pool_slab* slabs;
+} evsig_pool;
+
+// max_objects 0 means no cap.
+//
+// New slabs go to the cache of the thread that needed them. If numa_local is
+// true, each slab is also bound to and faulted in on that thread's NUMA node
+// (MPOL_LOCAL). Objects freed by a thread on another node are reused there.
+void evsig_pool_init(evsig_pool* p, uint64_t obj_size, uint64_t max_objects, bool numa_local);
+
+// Frees every slab. Every object must have been freed, and threads that used
+// the pool must have exited or called evsig_pool_thread_flush on it.
+void evsig_pool_destroy(evsig_pool* p);
+
+// Returns NULL only if a SIGNAL_POOL_EXHAUSTED handler rejected the allocation,
+// or mapping a new slab failed and its errno signal (e.g. SIGNAL_ENOMEM) was
+// continued. The latter doesn't send SIGNAL_POOL_EXHAUSTED.
+void* evsig_pool_alloc(evsig_pool* p);
+
+// Call me from any thread. NULL is a safe no-op.
+void evsig_pool_free(evsig_pool* p, void* obj);
+
+// Returns the calling thread's cached objects of p to the pool
+void evsig_pool_thread_flush(evsig_pool* p);
+
+typedef struct {
+  evsig_pool* pool;
+  void*       obj;
+} _evsig_pool_ref;
+
+void _unwind_handler_pool_free(void* ref);
+
+#define EVSIG_POOL_ALLOC(pool, type) ((type*)evsig_pool_alloc(pool))
+
+// Frees obj back to pool at end of scope or on unwind
+#define UNWIND_POOL_FREE(pool, obj) \
+  _UNWIND_POOL_FREE(pool, obj, GENSYM(poolref))
+
+#define _UNWIND_POOL_FREE(pool, obj, gensym) \
+  _evsig_pool_ref gensym = { pool, obj }; \
+  UNWIND_ACTION_CLASS(UNWIND_CLASS_MEMORY, _unwind_handler_pool_free, &gensym)
+
+#ifdef __cplusplus
+}
+#endif
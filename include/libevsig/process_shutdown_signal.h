@@ -0,0 +1,101 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "libevsig/evsig_mutex.h"
+
+// A shutdown signal that works across processes, for example a prefork
+// master asking all of its workers to unwind and waiting until they have.
+//
+// Unlike evsig_thread_shutdown_signal, this contains no pointers and
+// doesn't allocate, so it can be placed in a MAP_SHARED region created
+// before forking. Threads are tracked as (pid, tid) pairs, and sending and
+// confirming use process-shared futexes.
+//
+// Typical usage:
+//
+//   evsig_process_shutdown_signal* s =
+//     sw_mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE,
+//             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+//   evsig_process_shutdown_signal_init(s);
+//
+//   // In each worker after fork():
+//   evsig_process_shutdown_signal_attach(s, true);
+//
+//   // In the master:
+//   evsig_process_shutdown_signal_send_block(s, 10000);
+//
+// Registered threads that die (or whose process dies) without confirming are
+// noticed while a send is waiting and don't hold it up.
+
+#define EVSIG_PROCESS_SHUTDOWN_SIGNAL_MAX_THREADS 1024
+
+typedef struct {
+  pid_t pid;
+  pid_t tid;
+} evsig_process_thread;
+
+typedef struct {
+  // Futex word. 0 until the signal is sent, then 1.
+  _Atomic uint32_t shutdown;
+
+  // Futex word. Number of registered threads that haven't confirmed yet.
+  _Atomic uint32_t threads_fill;
+
+  evsig_mutex          mutex;
+  evsig_process_thread threads[EVSIG_PROCESS_SHUTDOWN_SIGNAL_MAX_THREADS];
+} evsig_process_shutdown_signal;
+
+// Initializes a signal in place. Call once, before any process uses it.
+void evsig_process_shutdown_signal_init(evsig_process_shutdown_signal* s);
+
+// Adds a thread for which we will await exit when the signal is sent.
+//
+// Returns false if EVSIG_PROCESS_SHUTDOWN_SIGNAL_MAX_THREADS threads are
+// already registered.
+//
+// Safe no-op (returning true) if this thread is already registered.
+//
+// Call me from any thread in any process.
+bool evsig_process_shutdown_signal_register_thread(evsig_process_shutdown_signal* s,
+                                                   pid_t pid,
+                                                   pid_t tid);
+
+// Notifies us that this thread has shut down.
+//
+// Call me from any thread in any process.
+void evsig_process_shutdown_signal_confirm_shutdown(evsig_process_shutdown_signal* s,
+                                                    pid_t pid,
+                                                    pid_t tid);
+
+// Sends the shutdown signal, then blocks until all registered threads have
+// confirmed or died, or until timeout_ms has elapsed.
+//
+// Resending is a no-op (but safe).
+//
+// Returns true if timeout elapsed, else false
+//
+// Call me from any thread in any process.
+bool evsig_process_shutdown_signal_send_block(evsig_process_shutdown_signal* s,
+                                              uint64_t timeout_ms);
+
+// Blocks until the signal is sent or timeout_ms has elapsed. Pass UINT64_MAX
+// to wait forever.
+//
+// Returns true if the signal was sent.
+bool evsig_process_shutdown_signal_wait(evsig_process_shutdown_signal* s,
+                                        uint64_t timeout_ms);
+
+// True if it's time to shut down
+bool evsig_process_shutdown_p(evsig_process_shutdown_signal* s);
+
+// Connects this process to s. Starts a thread, registered with s, that waits
+// for s to be sent. When it is, the thread sends
+// evsig_global_thread_shutdown_signal (so every thread in this process
+// unwinds as it would for an unhandled signal), waits for it, then confirms.
+// If exit_process is true, it then calls exit().
+//
+// Call once per process, after fork(). Safe no-op if this process is
+// already attached to s.
+void evsig_process_shutdown_signal_attach(evsig_process_shutdown_signal* s,
+                                          bool exit_process);
@@ -0,0 +1,93 @@
+#pragma once
+#include <stdint.h>
+#include "libevsig/signals.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Retry policies for resumable signals (see SIG_RESTART_RETRY in signals.h),
+// such as those sent by sw_connect, sw_read, sw_write, sw_pwrite and sw_fsync.
+//
+// Replaces hand-rolled backoff around a restart: the failed call is retried in
+// place after a delay, without unwinding. Once the policy gives up, the
+// handler declines and the signal falls through to the next handler as usual.
+//
+//   static const char* const connect_errors[] = {
+//     SIGNAL_ECONNREFUSED, SIGNAL_ETIMEDOUT, SIGNAL_EHOSTUNREACH,
+//     SIGNAL_ENETUNREACH, NULL
+//   };
+//
+//   static sig_retry_policy connect_retry = {
+//     .max_attempts  = 8,
+//     .base_delay_ns = 10000000,   // 10ms
+//     .max_delay_ns  = 5000000000, // 5s
+//     .jitter_pct    = 50,
+//     .deadline_ns   = 30000000000,
+//     .retry_on      = connect_errors,
+//   };
+//
+//   SIG_AUTOPOP_RETRY(&connect_retry);
+//   sw_connect(fd, addr, addr_len);
+//
+// The handler sleeps in the failing thread between attempts, so it's for
+// blocking code. Don't use it in an event loop thread: leave EAGAIN to your
+// poller.
+//
+// A policy can be shared between threads. Only the counters are written.
+
+typedef struct {
+  // Give up after this many failures of one call. 0 means no limit.
+  uint32_t max_attempts;
+
+  // Delay before the first retry, multiplied by multiplier (0 means 2) for
+  // each retry after that, up to max_delay_ns (0 means no cap).
+  uint64_t base_delay_ns;
+  uint64_t max_delay_ns;
+  uint32_t multiplier;
+
+  // Up to this percentage of each delay is randomly removed, so many
+  // clients failing at once don't retry in lockstep.
+  uint32_t jitter_pct;
+
+  // Give up if a retry would start more than this long after the first
+  // failure of the call. 0 means no deadline.
+  uint64_t deadline_ns;
+
+  // NULL-terminated list of signal types to retry. NULL means
+  // sig_retry_transient_types.
+  const char* const* retry_on;
+
+  // Counters, zero-initialized. Safe to read from any thread.
+  _Atomic uint64_t retries;
+  _Atomic uint64_t delay_ns_total;
+  _Atomic uint64_t exhausted;         // Gave up at max_attempts
+  _Atomic uint64_t deadline_exceeded; // Gave up at deadline_ns
+} sig_retry_policy;
+
+// Signal types that are worth retrying whatever the call: EINTR, EBUSY,
+// ENOBUFS, and EHOSTUNREACH/ENETUNREACH/ENETDOWN while the network comes back.
+// NULL-terminated.
+//
+// EAGAIN isn't included, as non-blocking code should wait for readiness
+// rather than sleep. Neither are connection errors (ECONNREFUSED, ECONNRESET,
+// ECONNABORTED, ETIMEDOUT): retrying a write or read on a connection that was
+// reset can't succeed, and for connect it's a decision for the caller. List
+// them in retry_on where they make sense.
+extern const char* const sig_retry_transient_types[];
+
+// Handler implementing a policy. userdata is the sig_retry_policy.
+//
+// Declines signals that aren't resumable or aren't in the policy's retry_on.
+const char* sig_retry_handler(const char* sig_type,
+                              void* userdata,
+                              const char* msg,
+                              void* signal_data);
+
+// Applies a policy to the rest of the scope
+#define SIG_AUTOPOP_RETRY(policy) \
+  SIG_AUTOPOP_HANDLER(SIGNAL_ALL, sig_retry_handler, policy)
+
+#ifdef __cplusplus
+}
+#endif
@@ -72,6 +72,24 @@ SIG_DECLTYPE(SIGNAL_UNSUPPORTED);
 // Works the same way as signal definitions above
 SIG_DECLTYPE(SIG_RESTART_NULL);
 
+// In-place restarts
+//
+// These are always available to handlers of signals sent with
+// SIG_SEND_RESUMABLE or SIG_RESUMABLE, which includes the sw_* wrappers. They
+// don't unwind: execution continues right where the signal was sent, with no
+// setjmp at the call site.
+//
+// SIG_RESTART_RETRY     - Run the failed operation again
+// SIG_RESTART_USE_VALUE - Use a value as the operation's result, see sig_use_value
+// SIG_RESTART_CONTINUE  - Return the failed result as-is, as if there were no
+//                         signal
+//
+// Selecting one of these for a non-resumable send behaves like any other
+// restart: a normal restart of the same type must be on the restart stack.
+SIG_DECLTYPE(SIG_RESTART_RETRY);
+SIG_DECLTYPE(SIG_RESTART_USE_VALUE);
+SIG_DECLTYPE(SIG_RESTART_CONTINUE);
+
 // Call PER THREAD to init the signal system and unwind system.
 //
 // If threadlocal is true, the behavior the signal system is purely
@@ -113,9 +131,74 @@ typedef const char* (*sig_handler)(const char* sig_type,
                                    const char* msg,
                                    void* signal_data);
 
+// Dispatch policy for a handler, for handlers like logging that can see
+// storms of the same signal (e.g. SIGNAL_ECONNREFUSED during an outage).
+//
+// Checked in the send path before the handler is called. When a send is
+// suppressed, the handler isn't called and its last decision is reused: if it
+// last declined, the signal falls through to the next handler, and if it last
+// selected a restart, that restart runs again.
+//
+// Zero-initialize, set the config fields, and attach with
+// SIG_PERSISTENT_HANDLER_POLICY or SIG_AUTOPOP_HANDLER_POLICY. A policy holds
+// its own state, so it must outlive the handler and must not be shared between
+// threads.
+#define SIG_DISPATCH_POLICY_DEDUP_SLOTS   16
+#define SIG_DISPATCH_POLICY_SUMMARY_SLOTS 8
+
+typedef struct {
+  // Token bucket. The handler runs at most rate_per_sec times per second on
+  // average, with bursts of up to burst (at least 1). 0 rate means unlimited.
+  uint64_t rate_per_sec;
+  uint64_t burst;
+
+  // Suppress repeats of the same signal type from the same send site (the
+  // SIG_SEND or SIG_RESUMABLE in your code, or your call to a sw_* wrapper)
+  // within this window. 0 disables.
+  uint64_t dedup_window_ns;
+
+  // Optional. Called once per suppressed signal type, with how many sends of
+  // that type were suppressed, when the handler next runs and when it is
+  // removed. Also called early if more than SIG_DISPATCH_POLICY_SUMMARY_SLOTS
+  // types are suppressed in between.
+  void (*summary)(const char* sig_type, uint64_t suppressed, void* userdata);
+  void* summary_userdata;
+
+  // State, zero-initialized
+  uint64_t    nanotokens;
+  uint64_t    last_refill_ns;
+  const char* last_restart;
+  struct {
+    const char* sig_type;
+    uint64_t    count;
+  } suppressed[SIG_DISPATCH_POLICY_SUMMARY_SLOTS];
+  struct {
+    const char* sig_type;
+    const void* site;
+    uint64_t    last_ns;
+  } dedup[SIG_DISPATCH_POLICY_DEDUP_SLOTS];
+} sig_dispatch_policy;
+
+typedef struct {
+  uint32_t attempt;  // Failures so far, including the current one
+  uint64_t start_ns; // Free for handlers, e.g. when the first failure happened
+
+  // Optional, set by the sender: one more restart type that is handled in
+  // place for this send, such as SIG_RESTART_POOL_GROW
+  const char* extra_restart;
+} sig_resume_state;
+
+// A clause of SIG_AUTOPOP_HANDLER_TABLE
+typedef struct {
+  const char* sig_type;
+  sig_handler handler;
+  void*       userdata;
+} sig_clause;
+
 // Implementation details
 #include "_signals.h"
 #include "unwind.h"
+#include "thread_signal.h"
 
 // Convenience handler that selects whatever restart it's passed as userdata
 const char* sig_static_handler(const char* sig_type, void* userdata, char* msg, void* signal_data);
@@ -124,12 +207,93 @@ const char* sig_static_handler(const char* sig_type, void* userdata, char* msg,
 #define SIG_SEND(sig_type, msg, signal_data, signal_data_cleanup_func) \
   _SIG_SEND(sig_type, msg, signal_data, signal_data_cleanup_func, GENSYM(sigsend));
 
+// Send a signal that handlers may resume in place (see SIG_RESTART_RETRY and
+// friends above).
+//
+// Evaluates to the in-place restart the handler selected, or SIG_RESTART_NULL
+// if every handler declined. For SIG_RESTART_USE_VALUE, the value is stored
+// in *value_out (may be NULL).
+#define SIG_SEND_RESUMABLE(sig_type, msg, signal_data, signal_data_cleanup_func, value_out) \
+  _sig_send_resumable(NULL, _SIG_SITE(), sig_type, msg, signal_data, \
+                      signal_data_cleanup_func, value_out)
+
+// Assigns call to result, and if failed (an expression on result) is true,
+// sends a resumable signal and acts on the selected in-place restart: runs
+// call again for SIG_RESTART_RETRY, or assigns the handler's value to result
+// for SIG_RESTART_USE_VALUE.
+//
+// sig_type and msg are evaluated after the call, so errno is available to them.
+#define SIG_RESUMABLE(result, call, failed, sig_type, msg) \
+  _SIG_RESUMABLE(result, call, failed, sig_type, msg, \
+                 GENSYM(sigresr), GENSYM(sigresv), GENSYM(sigress))
+
+// SIG_RESUMABLE for calls that set errno: when the call fails with EINTR
+// (from a signal, or the SIGUSR2 that evsig_signal_thread sends), runs
+// SIG_CHECKPOINT() and retries instead of sending. Not for calls that mustn't
+// be repeated after EINTR, such as close().
+#define SIG_RESUMABLE_EINTR(result, call, failed, sig_type, msg) \
+  _SIG_RESUMABLE_EINTR(result, call, failed, sig_type, msg, \
+                       GENSYM(sigresr), GENSYM(sigresv), GENSYM(sigress))
+
+// For use in handlers: select SIG_RESTART_USE_VALUE with this value.
+//
+//   return sig_use_value((intptr_t)fallback);
+const char* sig_use_value(intptr_t value);
+
+// For use in handlers: state of the resumable send being handled, or NULL if
+// the signal isn't resumable. Persists across SIG_RESTART_RETRY, so handlers
+// can tell how many times the operation has failed.
+sig_resume_state* sig_resume_current();
+
+// Whether this thread has a handler for exactly sig_type (not counting
+// SIGNAL_ALL handlers). For senders of optional, informational signals that
+// shouldn't reach the catch-all handler.
+bool sig_has_handler(const char* sig_type);
+
 #define SIG_AUTOPOP_RESTART(sig_type, restart_type, restart_action) \
   _SIG_PROVIDE_AUTOPOP_RESTART(sig_type, restart_type, { restart_action; }, GENSYM(sigaprestart), GENSYM(sigaprestartb))
 
 #define SIG_PROVIDE_RESTART(sig_type, might_signal_code, restart_type, restart_action) \
   _SIG_PROVIDE_RESTART(sig_type, { might_signal_code; }, restart_type, { restart_action; }, GENSYM(sigprestart), GENSYM(sigprestartb))
 
+// Like SIG_AUTOPOP_RESTART, but restart_action can read a copy of the
+// arguments the handler passed with sig_restart_args as args_name, of
+// args_type (at most UNWIND_RETURN_POINT_ARGS_MAX bytes). Zeroed if the
+// handler didn't pass any.
+//
+// args_name is a fresh local after the jump, so it doesn't need to be
+// volatile the way locals changed after the restart point do.
+#define SIG_AUTOPOP_RESTART_ARGS(sig_type, restart_type, args_type, args_name, restart_action) \
+  _SIG_PROVIDE_AUTOPOP_RESTART_ARGS(sig_type, restart_type, args_type, args_name, { restart_action; }, \
+                                    GENSYM(sigaprestart), GENSYM(sigaprestartb))
+
+// Like SIG_PROVIDE_RESTART, with arguments as in SIG_AUTOPOP_RESTART_ARGS
+#define SIG_PROVIDE_RESTART_ARGS(sig_type, might_signal_code, restart_type, args_type, args_name, restart_action) \
+  _SIG_PROVIDE_RESTART_ARGS(sig_type, { might_signal_code; }, restart_type, args_type, args_name, \
+                            { restart_action; }, GENSYM(sigprestart), GENSYM(sigprestartb))
+
+// For use in handlers: select restart_type, passing it size bytes of args
+// (at most UNWIND_RETURN_POINT_ARGS_MAX). The args are copied, so a local
+// is fine, and they belong to the send being handled: signals the handler
+// sends itself don't disturb them. Args set by a handler that then declines
+// are dropped. Use as the handler's last step:
+//
+//   SIG_DEFTYPE(SIG_RESTART_RECONNECT); // Your own restart type
+//   typedef struct { uint64_t delay_ns; } backoff_args;
+//
+//   const char* reconnect_handler(const char* sig_type, void* ud,
+//                                 const char* msg, void* signal_data) {
+//     backoff_args a = { .delay_ns = next_delay() };
+//     return sig_restart_args(SIG_RESTART_RECONNECT, &a, sizeof(a));
+//   }
+//
+//   SIG_AUTOPOP_RESTART_ARGS(SIGNAL_ECONNRESET, SIG_RESTART_RECONNECT,
+//                            backoff_args, a, {
+//     evsig_sleep_ns(a.delay_ns);
+//     goto reconnect;
+//   });
+const char* sig_restart_args(const char* restart_type, const void* args, size_t size);
+
 // Define a signal handler. Handler is removed at end of scope.
 //
 // If the handler function is NULL, this is a safe no-op.
@@ -140,6 +304,53 @@ const char* sig_static_handler(const char* sig_type, void* userdata, char* msg,
 #define SIG_PERSISTENT_HANDLER(sig_type, handler, userdata) \
   _sig_push_handler(sig_type, handler, userdata)
 
+// Like SIG_AUTOPOP_HANDLER, for pure handlers: the restart returned depends
+// only on the signal type and userdata, and calling the handler has no side
+// effects. A pure handler's decision is cached per signal type until the
+// handler stack next changes, so repeated sends skip the handler scan and
+// call. Decisions made with sig_use_value or sig_restart_args aren't cached,
+// as only the restart type would be replayed.
+//
+// sig_static_handler is always treated as pure.
+#define SIG_AUTOPOP_PURE_HANDLER(sig_type, handler, userdata) \
+  _SIG_AUTOPOP_PURE_HANDLER(sig_type, handler, userdata, GENSYM(sighandler))
+
+// Like SIG_PERSISTENT_HANDLER, for pure handlers (see SIG_AUTOPOP_PURE_HANDLER)
+#define SIG_PERSISTENT_PURE_HANDLER(sig_type, handler, userdata) \
+  _sig_push_pure_handler(sig_type, handler, userdata)
+
+// Clause calling a handler
+#define SIG_HANDLER_CASE(sig_type, handler, userdata) \
+  { sig_type, (sig_handler)(handler), (void*)(userdata) }
+
+// Clause selecting a restart directly, without a handler call. These are
+// pure (see SIG_AUTOPOP_PURE_HANDLER).
+#define SIG_RESTART_CASE(sig_type, restart_type) \
+  { sig_type, (sig_handler)sig_static_handler, (void*)(restart_type) }
+
+// Handles several signal types for the rest of the scope with one handler
+// stack entry, like a switch over signal types. The clauses are a static
+// const table built at compile time, so entering and leaving the scope costs
+// the same no matter how many clauses there are. An exact clause wins over a
+// SIGNAL_ALL clause in the same table. Arguments must be constant.
+//
+//   SIG_DEFTYPE(SIG_RESTART_RECONNECT); // Your own restart type, at file scope
+//
+//   SIG_AUTOPOP_HANDLER_TABLE(
+//     SIG_RESTART_CASE(SIGNAL_EAGAIN, SIG_RESTART_RETRY),
+//     SIG_RESTART_CASE(SIGNAL_ECONNRESET, SIG_RESTART_RECONNECT),
+//     SIG_HANDLER_CASE(SIGNAL_ALL, log_handler, NULL));
+#define SIG_AUTOPOP_HANDLER_TABLE(...) \
+  _SIG_AUTOPOP_HANDLER_TABLE(GENSYM(sighandler), GENSYM(sigtable), __VA_ARGS__)
+
+// Like SIG_AUTOPOP_HANDLER, with a sig_dispatch_policy
+#define SIG_AUTOPOP_HANDLER_POLICY(sig_type, handler, userdata, policy) \
+  _SIG_AUTOPOP_HANDLER_POLICY(sig_type, handler, userdata, policy, GENSYM(sighandler))
+
+// Like SIG_PERSISTENT_HANDLER, with a sig_dispatch_policy
+#define SIG_PERSISTENT_HANDLER_POLICY(sig_type, handler, userdata, policy) \
+  _sig_push_handler_policy(sig_type, handler, userdata, policy)
+
 // Remove a signal handler by id returned from SIG_PERSISTENT_HANDLER
 #define SIG_RM_HANDLER(id) \
   _sig_rm_handler(id)
@@ -18,9 +18,33 @@ extern "C" {
 // TODO mmap
 // TODO munmap
 
+// Wrappers that may block (file and socket I/O, syncs, sw_getrandom, and
+// sw_epoll_wait/sw_connect in their own headers) are cancellation points:
+// they run SIG_CHECKPOINT() before the call, and when the call fails with
+// EINTR (which the SIGUSR2 sent to a thread targeted with
+// evsig_cancel_thread or evsig_unwind_thread causes) they run it again and
+// retry, so the thread handles the signal without waiting for the call. An
+// EINTR with nothing pending is retried, never sent as SIGNAL_EINTR.
+//
+// They check again after the call only if it failed. A signal that arrives
+// while a call succeeds is handled at the next check point, so a completed
+// read, write or join is never unwound past and its result lost. For the same
+// reason sw_fread/sw_fwrite interrupted part way return the short count, with
+// the stream's error indicator clear, rather than unwinding.
+//
+// sw_pthread_join checks before and after a failure, but pthread_join itself
+// can't be interrupted.
+//
+// Wrappers that fail with errno (and the allocators) send resumable signals:
+// handlers can select SIG_RESTART_RETRY, SIG_RESTART_USE_VALUE (the value
+// becomes the wrapper's return value) or SIG_RESTART_CONTINUE without
+// unwinding. See signals.h. The allocators also offer
+// SIG_RESTART_RECLAIM_RETRY, see memory.h.
+
 void*       sw_malloc   (size_t size);
 void*       sw_calloc   (size_t nmemb, size_t size);
 void*       sw_realloc  (void* ptr, size_t size);
+void        sw_free     (void* ptr); // For the allocation profiler, see alloc_profile.h
 size_t      sw_fread    (void* ptr, size_t size, size_t nmemb, FILE* stream);
 size_t      sw_fwrite   (const void* ptr, size_t size, size_t nmemb, FILE* stream);
 ssize_t     sw_pwrite   (int fd, const void* buf, size_t nbyte, off_t offset);
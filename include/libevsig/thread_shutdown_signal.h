@@ -15,8 +15,26 @@
 // signal if you want to be able to exit cleanly.
 //
 // To determine when your thread should exit cleanly, you can register a
-// callback to receive the event or use evsig_shutdown_p to check
-// if it's time to shut down.
+// callback to receive the event, use evsig_shutdown_p to check
+// if it's time to shut down, or wait on the signal's eventfd from your
+// event loop.
+//
+// Shutdown signals can be arranged into a tree of groups with
+// evsig_thread_shutdown_signal_add_child. Sending a signal first drains its
+// children one at a time in ascending phase order (each bounded by its own
+// timeout), then notifies and awaits the signal's own threads. This lets you,
+// for example, stop accepting connections, then let request workers finish,
+// then stop flush threads. Sending a child directly shuts down only that
+// subtree.
+//
+// fork() is handled for evsig_global_thread_shutdown_signal and its group
+// tree: in the child, only the forking thread stays registered (under its new
+// tid), eventfds are closed rather than shared with the parent, and the
+// shutdown thread is restarted by the child's first sig_init, unwind_all or
+// call into this API that registers, sends or adds a callback (not from the
+// fork handler, where creating threads isn't safe). Other signals are left
+// untouched. For
+// shutting down multiple processes, see process_shutdown_signal.h.
 
 #define EVSIG_THREAD_SHUTDOWN_SIGNAL_INIT (evsig_thread_shutdown_signal)\
   { .shutdown                 = false,\
@@ -30,16 +48,45 @@
     .master_mutex = 0,\
     .shutdown_thread_started = false,\
     .shutdown_mutex = 1,\
-    .shutdown_thread_exit = false\
+    .shutdown_thread_exit = false,\
+    .eventfd = -1,\
+    .parent         = NULL,\
+    .children       = NULL,\
+    .children_fill  = 0,\
+    .children_alloc = 0,\
+    .phase          = 0,\
+    .timeout_ms     = EVSIG_THREAD_SHUTDOWN_DEFAULT_TIMEOUT_MS,\
+    .timings        = NULL,\
+    .timings_fill   = 0\
   }
 
+#define EVSIG_THREAD_SHUTDOWN_DEFAULT_TIMEOUT_MS 5000
+
 typedef struct {
   uint64_t id;
   void (*cb)(void*);
   void* ud;
 } evsig_thread_shutdown_cb;
 
+// Shutdown timing for one registered thread, see
+// evsig_thread_shutdown_signal_send_block_report
+typedef struct {
+  pid_t       tid;
+  char        name[16]; // From /proc, empty if unavailable
+  const void* group;    // The evsig_thread_shutdown_signal the thread was registered with
+
+  uint64_t notified_us;  // When the thread's signal was sent
+  uint64_t confirmed_us; // When the thread confirmed or was found dead. 0 if neither.
+  bool     exited;       // The thread died without confirming
+} evsig_thread_shutdown_timing;
+
 typedef struct {
+  evsig_thread_shutdown_timing* entries;
+  uint64_t                      fill;
+  uint64_t                      alloc;
+} evsig_thread_shutdown_report;
+
+typedef struct evsig_thread_shutdown_signal {
   // False until signal sent, then true. Feel free to check this instead
   // of registering a callback as a convenience if you're happy to poll instead.
   //
@@ -60,6 +107,24 @@ typedef struct {
   bool        shutdown_thread_started;
 
   bool shutdown_thread_exit;
+
+  // -1 until evsig_thread_shutdown_signal_eventfd is first called
+  int eventfd;
+
+  // Group tree. children is kept sorted by phase.
+  struct evsig_thread_shutdown_signal*  parent;
+  struct evsig_thread_shutdown_signal** children;
+  uint64_t                              children_fill;
+  uint64_t                              children_alloc;
+  uint32_t                              phase;
+
+  // How long to wait for this signal's own threads when it's sent as part of
+  // a group or by the shutdown thread.
+  uint64_t timeout_ms;
+
+  // Per-thread timings for a send in progress
+  evsig_thread_shutdown_timing* timings;
+  uint64_t                      timings_fill;
 } evsig_thread_shutdown_signal;
 
 extern evsig_thread_shutdown_signal evsig_global_thread_shutdown_signal;
@@ -74,20 +139,50 @@ extern evsig_thread_shutdown_signal evsig_global_thread_shutdown_signal;
 // Frees resources associated with this signal. Thus, resending the signal
 // is a no-op (but safe)
 //
-// Blocks until either all threads associated with this signal have stopped
-// or timeout_ms has elapsed.
+// If this signal has children, they are sent first in ascending phase order,
+// each waiting up to its own timeout_ms. Then blocks until either all threads
+// associated with this signal have stopped or timeout_ms has elapsed.
 //
-// Returns true if timeout elapsed, else false
+// Returns true if timeout elapsed for this signal or any child, else false
 //
 // Call me from any thread.
 bool evsig_thread_shutdown_signal_send_block(evsig_thread_shutdown_signal* s,
                                              uint64_t timeout_ms);
+
+// Same as evsig_thread_shutdown_signal_send_block, but also records when each
+// registered thread (including those of children) was notified and when it
+// confirmed, appending one entry per thread to report.
+//
+// report must be zero-initialized or previously used with this function.
+// Free it with evsig_thread_shutdown_report_free.
+//
+// Call me from any thread.
+bool evsig_thread_shutdown_signal_send_block_report(evsig_thread_shutdown_signal* s,
+                                                    uint64_t timeout_ms,
+                                                    evsig_thread_shutdown_report* report);
+
+// Sorts report so that threads that never confirmed come first, followed by
+// the rest slowest to fastest.
+void evsig_thread_shutdown_report_sort(evsig_thread_shutdown_report* report);
+
+// Writes up to max_entries report entries in their current order to fd. Pass
+// 0 for max_entries to write all of them.
+//
+// Formats with snprintf into a stack buffer and writes with write(), without
+// stdio streams, allocation or locks. Not async-signal-safe.
+void evsig_thread_shutdown_report_print(const evsig_thread_shutdown_report* report,
+                                        int      fd,
+                                        uint64_t max_entries);
+
+void evsig_thread_shutdown_report_free(evsig_thread_shutdown_report* report);
 // Sends the shutdown signal without blocking.
 //
 // Async-handler safe.
 //
-// If exit_process is true, will wait up to 5 seconds for all threads
-// to confirm shutdown, then will call exit().
+// The send happens on the signal's shutdown thread, which waits up to the
+// signal's timeout_ms (5 seconds unless changed) for its threads and prints a
+// report of the threads that held it up if that elapses. If exit_process is
+// true, exit() is called afterwards.
 void evsig_thread_shutdown_signal_send_async(evsig_thread_shutdown_signal* s,
                                              bool     exit_process);
 
@@ -126,7 +221,11 @@ void unwind_handler_evsig_thread_shutdown_signal_unregister_cb(void* ptr);
 // signal is sent.
 //
 // We consider a thread shut-down when
-// evsig_thread_shutdown_signal_confirm_shutdown is called.
+// evsig_thread_shutdown_signal_confirm_shutdown is called, or when the thread
+// no longer exists. If a thread registers itself (t == gettid()), shutdown is
+// confirmed for it automatically when it exits. Threads registered by another
+// thread are checked for liveness while a send is waiting on them. Either way,
+// a dead thread never holds up a shutdown.
 //
 // Call me from any thread.
 //
@@ -148,3 +247,60 @@ void evsig_thread_shutdown_signal_confirm_shutdown(evsig_thread_shutdown_signal*
 
 // True if it's time to shut down
 bool evsig_thread_shutdown_p(evsig_thread_shutdown_signal* s);
+
+// Returns an eventfd that becomes readable (EPOLLIN) once this signal is sent,
+// creating it on first call. Subsequent calls return the same fd.
+//
+// Intended to be added to an epoll set via sw_epoll_ctl so event loops can
+// wake on shutdown instead of polling evsig_thread_shutdown_p. Don't read
+// from the fd: it stays readable for every watcher as long as nobody
+// consumes the counter.
+//
+// If the signal has already been sent, the returned fd is already readable.
+//
+// Returns -1 with errno set if the eventfd couldn't be created.
+//
+// Call me from any thread.
+int evsig_thread_shutdown_signal_eventfd(evsig_thread_shutdown_signal* s);
+
+// Closes the eventfd created by evsig_thread_shutdown_signal_eventfd, if any.
+//
+// Sending the signal does not close it, as watchers may not have woken up yet.
+// Remove it from your epoll sets before calling this.
+//
+// Call me from any thread.
+void evsig_thread_shutdown_signal_close_eventfd(evsig_thread_shutdown_signal* s);
+
+// Sets how long to wait for this signal's own threads when it's sent as part
+// of a group or via evsig_thread_shutdown_signal_send_async.
+//
+// Call me from any thread.
+void evsig_thread_shutdown_signal_set_timeout(evsig_thread_shutdown_signal* s,
+                                              uint64_t timeout_ms);
+
+// Makes child a member of parent's group. Sending parent will send child
+// before parent's own threads are notified.
+//
+// Children are sent one at a time in ascending phase order. Children with the
+// same phase are sent in the order they were added.
+//
+// If child already belongs to a group, it is moved. child must stay alive
+// until removed via evsig_thread_shutdown_signal_remove_child or until the
+// parent has been sent.
+//
+// Returns false (and does nothing) if child is parent or one of its
+// ancestors, which would make a cycle.
+//
+// Call me from any thread.
+bool evsig_thread_shutdown_signal_add_child(evsig_thread_shutdown_signal* parent,
+                                            evsig_thread_shutdown_signal* child,
+                                            uint32_t phase);
+
+// Removes child from parent's group. Safe no-op if it isn't a member.
+//
+// Call me from any thread.
+void evsig_thread_shutdown_signal_remove_child(evsig_thread_shutdown_signal* parent,
+                                               evsig_thread_shutdown_signal* child);
+
+// Restarts shutdown threads in a forked child, see above
+void _evsig_thread_shutdown_restart_after_fork();
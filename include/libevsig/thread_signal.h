@@ -0,0 +1,310 @@
+#pragma once
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <threads.h>
+#include "libevsig/evsig_mutex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Delivering evsig signals into a specific thread.
+//
+// Signals are normally sent from the thread that handles them. The functions
+// here let another thread ask a thread to handle a signal instead, for
+// example to unwind a single stuck worker out of its current request without
+// shutting down the whole process.
+//
+// Delivery is cooperative: the signal is handled the next time the target
+// thread reaches a check point (SIG_CHECKPOINT(), or any signal send). The
+// target is also sent SIGUSR2 so that a blocking syscall returns EINTR,
+// which the sigwrap wrappers handle as a check point before retrying.
+//
+// The SIGUSR2 handler is installed without SA_RESTART (otherwise most
+// blocking calls would restart rather than return), so blocking calls a
+// targeted thread makes outside sigwrap can fail with EINTR too. Retry those
+// yourself, or use the sw_* wrappers.
+//
+// Any thread that has called sig_init can be targeted. The signal goes
+// through the target's handler stack as usual, so the target needs a handler
+// that selects one of its restarts, or the catchall handler will shut the
+// process down.
+//
+// For event-based programming, signals can also be posted to a thread's
+// queue with SIG_POST and are dispatched through its handlers when it calls
+// sig_poll(), rather than at the next check point. Posting never blocks on
+// the target.
+//
+// For one-to-many events, threads can sig_subscribe to signal types and
+// SIG_BROADCAST fans a signal out to every subscriber, also dispatched by
+// sig_poll. Each subscriber has its own bounded ring, and publishing takes no
+// lock, see sig_broadcast for what a publish costs.
+//
+// The same registry backs a watchdog: a thread can ask to be sent a signal
+// when it stops calling SIG_HEARTBEAT() for too long, so a worker stuck on a
+// bad request recovers through its own restarts without anyone restarting
+// the process.
+//
+// The watchdog is cooperative: delivery is the same as evsig_unwind_thread,
+// so the thread only unwinds at its next check point. A thread blocked in a
+// sigwrap wrapper is interrupted, but one spinning on the CPU without ever
+// reaching SIG_CHECKPOINT(), a sigwrap call or a SIG_SEND is never recovered.
+// CPU-bound loops that should be watched need a SIG_CHECKPOINT() in them.
+
+#define EVSIG_PENDING_MSG_MAX 256
+
+// A posted signal. Reference counted so that one payload can be queued to
+// several threads. signal_data_cleanup_func runs once, when the last
+// reference goes away.
+typedef struct {
+  _Atomic uint64_t refs;
+  const char*      sig_type;
+  char*            msg;
+  void*            signal_data;
+  void           (*signal_data_cleanup_func)(void*);
+} evsig_sig_payload;
+
+typedef struct evsig_posted_sig {
+  struct evsig_posted_sig* next;
+  evsig_sig_payload*       payload;
+} evsig_posted_sig;
+
+#ifndef EVSIG_BUS_RING_SIZE
+#define EVSIG_BUS_RING_SIZE 256 // Must be a power of two
+#endif
+
+#ifndef EVSIG_BUS_MAX_SUBSCRIBERS
+#define EVSIG_BUS_MAX_SUBSCRIBERS 1024
+#endif
+
+#define EVSIG_BUS_MAX_TYPES 16
+
+typedef struct {
+  _Atomic uint64_t   seq;
+  evsig_sig_payload* payload;
+} evsig_bus_cell;
+
+// Bounded multi-producer ring, one per subscriber. Only the subscriber
+// dequeues.
+typedef struct {
+  _Atomic uint64_t enqueue_pos;
+  uint64_t         dequeue_pos;
+
+  // Broadcasts that found this ring full
+  _Atomic uint64_t dropped;
+
+  evsig_bus_cell cells[EVSIG_BUS_RING_SIZE];
+} evsig_bus_ring;
+
+typedef struct evsig_thread_ctl {
+  pid_t tid;
+
+  // Registry bookkeeping. tid_next chains the tid lookup table, under the
+  // registry lock. refs counts other threads using this ctl outside the lock,
+  // which the owner waits out before it unregisters.
+  struct evsig_thread_ctl* tid_next;
+  _Atomic uint32_t         refs;
+
+  // Set by other threads, cleared when handled
+  _Atomic(const char*) pending_sig;
+  char                 pending_msg[EVSIG_PENDING_MSG_MAX];
+  evsig_mutex          pending_mutex;
+
+  // Only written by the owning thread
+  _Atomic uint64_t heartbeat;
+  _Atomic bool     watchdog_paused;
+
+  // Watchdog config, protected by the registry lock. deadline 0 is unwatched.
+  uint64_t    watchdog_deadline_ms;
+  const char* watchdog_sig;
+
+  // Watchdog monitor state
+  uint64_t watchdog_last_beat;
+  uint64_t watchdog_last_change_ms;
+
+  // Posted signals. A lock-free stack (newest first) pushed by any thread and
+  // emptied in one exchange by sig_poll.
+  _Atomic(evsig_posted_sig*) posted;
+
+  // Owner only. Taken from posted but not dispatched yet, oldest first.
+  evsig_posted_sig* posted_inflight;
+
+  // -1 until sig_post_eventfd is called. Read by posting threads without a
+  // lock.
+  _Atomic int wake_fd;
+
+  // NULL until the first sig_subscribe. Read by publishers without a lock,
+  // through the subscriber snapshot.
+  evsig_bus_ring*      bus_ring;
+  _Atomic(const char*) bus_types[EVSIG_BUS_MAX_TYPES];
+  _Atomic bool         bus_pending;
+
+  // Index in the subscriber list, under the registry lock. -1 if not
+  // subscribed. The owner checks bus_ring instead, as leaving subscribers
+  // move others.
+  int64_t              bus_slot;
+} evsig_thread_ctl;
+
+extern thread_local evsig_thread_ctl evsig_self;
+
+// Asks thread tid to handle sig_type at its next check point. msg is copied.
+//
+// Returns false if tid hasn't called sig_init, or if it already has a
+// signal pending (the new one is dropped).
+//
+// Call me from any thread.
+bool evsig_unwind_thread(pid_t tid, const char* sig_type, const char* msg);
+
+// Cooperative cancellation: asks thread tid to handle SIGNAL_ECANCELED at its
+// next check point, so its normal handlers, restarts and UNWIND_ACTIONs run.
+//
+// An alternative to pthread_cancel() that needs neither asynchronous
+// cancellation nor syscalls as cancellation points. Blocking sigwrap wrappers
+// are check points, and SIG_CHECKPOINT() can be added to long computations.
+//
+// Returns false under the same conditions as evsig_unwind_thread.
+//
+// Call me from any thread.
+bool evsig_cancel_thread(pid_t tid);
+
+// Watches the calling thread: if it goes deadline_ms without a
+// SIG_HEARTBEAT() (while not paused), sig_type is delivered to it as if by
+// evsig_unwind_thread. It then gets another deadline_ms before the next
+// delivery.
+//
+// Pass 0 for deadline_ms to stop watching. Call again to change the deadline
+// or signal.
+//
+// The signal is only acted on at a check point, see the overview above.
+//
+// In a forked child, the watchdog thread is restarted by the next sig_init,
+// sig_poll, SIG_POST, evsig_unwind_thread or evsig_watchdog_watch, if the
+// forking thread was being watched.
+void evsig_watchdog_watch(uint64_t deadline_ms, const char* sig_type);
+
+// Queues a signal for thread tid, to be dispatched through its handler stack
+// the next time it calls sig_poll. msg is copied. signal_data is passed to
+// the handlers and cleaned up by signal_data_cleanup_func (if not NULL) once
+// dispatched or discarded.
+//
+// Returns false if tid hasn't called sig_init, in which case
+// signal_data_cleanup_func is called right away.
+//
+// Call me from any thread.
+bool sig_post(pid_t tid,
+              const char* sig_type,
+              const char* msg,
+              void* signal_data,
+              void (*signal_data_cleanup_func)(void*));
+
+// Dispatches everything posted (then broadcast) to the calling thread, oldest
+// first, through
+// its handler stack as if each had been sent with SIG_SEND. Returns how many
+// were dispatched.
+//
+// Each dispatch offers SIG_RESTART_HANDLED: select it from your handler to
+// consume the signal and move on to the next one. As with SIG_SEND, a signal
+// nobody consumes reaches the catchall handler.
+//
+// If a handler selects some other restart, the signals not yet dispatched
+// stay queued for the next sig_poll.
+uint64_t sig_poll();
+
+extern const char SIG_RESTART_HANDLED[];
+
+// Subscribes the calling thread to broadcasts of sig_type (SIGNAL_ALL for
+// every broadcast). Safe no-op if already subscribed.
+//
+// Returns false if the thread already has EVSIG_BUS_MAX_TYPES subscriptions
+// or EVSIG_BUS_MAX_SUBSCRIBERS threads are subscribed.
+bool sig_subscribe(const char* sig_type);
+
+// Unsubscribes the calling thread from broadcasts of sig_type. sig_cleanup
+// unsubscribes from everything.
+void sig_unsubscribe(const char* sig_type);
+
+// Queues a signal for every thread subscribed to sig_type, to be dispatched
+// the next time each calls sig_poll. One payload is shared between all
+// subscribers, and signal_data_cleanup_func runs once the last of them is
+// done with it.
+//
+// A subscriber whose ring is full misses the broadcast. This is counted in
+// its ring's dropped counter.
+//
+// Takes no lock. Publishers read a snapshot of the subscribers, pinned with
+// one atomic increment and decrement per publish. Each matching subscriber
+// then costs a payload refcount increment, a CAS on its ring and an exchange
+// on its wakeup flag, which publishers to the same subscriber contend on.
+// Subscribing and unsubscribing are the slow side: they take the registry
+// lock and wait for publishes in progress.
+//
+// Returns how many subscribers the signal was queued for.
+//
+// Call me from any thread.
+uint64_t sig_broadcast(const char* sig_type,
+                       const char* msg,
+                       void* signal_data,
+                       void (*signal_data_cleanup_func)(void*));
+
+// Returns an eventfd for the calling thread that becomes readable when a
+// signal is posted or broadcast to it, creating it on first call. Add it to your epoll set
+// and call sig_poll when it's readable. Posting a burst of signals only wakes
+// you once, and sig_poll re-arms it.
+//
+// Returns -1 with errno set if the eventfd couldn't be created.
+int sig_post_eventfd();
+
+// Implementation details
+evsig_sig_payload* _sig_payload_new(const char* sig_type,
+                                    const char* msg,
+                                    void* signal_data,
+                                    void (*signal_data_cleanup_func)(void*));
+void               _sig_payload_unref(evsig_sig_payload* p);
+void _sig_deliver_pending();
+void _sig_thread_register();
+void _sig_thread_unregister();
+
+[[maybe_unused]]
+static inline void _sig_checkpoint() {
+  if (__builtin_expect(atomic_load_explicit(&evsig_self.pending_sig,
+                                            memory_order_relaxed) != NULL, 0))
+    _sig_deliver_pending();
+}
+
+// Handles any signal another thread asked us to handle. Costs one
+// thread-local load when nothing is pending.
+#define SIG_CHECKPOINT() _sig_checkpoint()
+
+// Posts a signal to another thread, see sig_post
+#define SIG_POST(tid, sig_type, msg, signal_data, signal_data_cleanup_func) \
+  sig_post(tid, sig_type, msg, signal_data, signal_data_cleanup_func)
+
+// Sends a signal to every subscribed thread, see sig_broadcast
+#define SIG_BROADCAST(sig_type, msg, signal_data, signal_data_cleanup_func) \
+  sig_broadcast(sig_type, msg, signal_data, signal_data_cleanup_func)
+
+// Tells the watchdog this thread is making progress. A relaxed thread-local
+// increment, cheap enough to call per request or loop iteration.
+#define SIG_HEARTBEAT() \
+  atomic_store_explicit(&evsig_self.heartbeat, \
+                        atomic_load_explicit(&evsig_self.heartbeat, memory_order_relaxed)+1, \
+                        memory_order_relaxed)
+
+// Pause the watchdog around intentional waits, such as an idle event loop
+// blocking in epoll_wait. Resuming counts as a heartbeat.
+#define SIG_WATCHDOG_PAUSE() \
+  atomic_store_explicit(&evsig_self.watchdog_paused, true, memory_order_relaxed)
+
+#define SIG_WATCHDOG_RESUME() \
+  do { \
+    SIG_HEARTBEAT(); \
+    atomic_store_explicit(&evsig_self.watchdog_paused, false, memory_order_relaxed); \
+  } while (false)
+
+// Restarts the watchdog thread in a forked child, see evsig_watchdog_watch
+void _evsig_watchdog_restart_after_fork();
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,17 +24,60 @@ extern "C" {
 
 #define GENSYM(base) _GENSYM(base, __COUNTER__)
 
+#define UNWIND_RETURN_POINT_ARGS_MAX 64
+
 typedef struct {
   bool returned;
   jmp_buf jbuf;
   int64_t unwind_to; // Point in unwind stack we should return to
+
+  // Filled in before unwinding to this point, e.g. with restart arguments
+  // from a signal handler (see sig_restart_args). Read it after the jump
+  // rather than locals changed since setjmp.
+  _Alignas(16) unsigned char args[UNWIND_RETURN_POINT_ARGS_MAX];
 } unwind_return_point;
 
 typedef void (*on_unwind_handler)(void* userdata);
 
+// Up to 8 bytes stored by value in an unwind entry, see UNWIND_VALUE_ACTION
+typedef struct {
+  _Alignas(8) unsigned char bytes[8];
+} unwind_value;
+
+typedef void (*on_unwind_value_handler)(unwind_value value);
+
+enum {
+  UNWIND_ENTRY_PTR   = 0,
+  UNWIND_ENTRY_VALUE = 1,
+};
+
+// What an unwind action does, so process-exit shutdown can skip work the
+// kernel will do for us anyway (see unwind_fast_exit).
+//
+// unwind_handler_free, unwind_batch_handler_free batches and
+// unwind_value_handler_close are classified automatically. Use
+// UNWIND_ACTION_CLASS / UNWIND_VALUE_ACTION_CLASS for your own handlers.
+enum {
+  UNWIND_CLASS_DEFAULT = 0, // Always runs
+  UNWIND_CLASS_MEMORY,      // Only releases memory. Skipped on fast exit.
+  UNWIND_CLASS_FD,          // Closes an fd given by value (an int). Closed in
+                            // bulk on fast exit, without calling the handler.
+  UNWIND_CLASS_LOCK,        // Releases a lock. Always runs.
+  UNWIND_CLASS_DURABLE,     // Flushes or syncs data. Always runs.
+};
+
+// Same size and layout as a plain { h, userdata } pair. The entry's
+// UNWIND_ENTRY_* kind and UNWIND_CLASS_* class are kept beside the stack, in
+// unwind.c.
 typedef struct {
-  on_unwind_handler h;
-  void* userdata;
+  union {
+    on_unwind_handler       h;
+    on_unwind_value_handler vh;
+  };
+  union {
+    void*        userdata;
+    unwind_value value;
+  };
 } unwind_handler_stack_entry;
 
 extern thread_local unwind_handler_stack_entry* unwind_stack;
@@ -50,6 +93,8 @@ extern thread_local uint64_t unwind_stack_fill;
 // We set handlers in unwind_init to do this if you have not.
 //
 // Never set SIGUSR2 if you need this mechanism to function. We've claimed it.
+// sig_init also uses it to interrupt blocking syscalls in a thread targeted by
+// evsig_unwind_thread (see thread_signal.h).
 //
 // This is useful because - for example - if you have an unwind handler to release a lock, you can
 // avoid a stale lock.
@@ -58,6 +103,16 @@ void unwind_dispatch_all();
 // Can be used as a thread shutdown signal instead of exit_thread_cb
 //extern _Atomic bool evsig_thread_shutdown_flag;
 
+// Set when the process is shutting down to exit (evsig_thread_shutdown_signal_send_async
+// with exit_process, which unwind_all and the OS signal handlers use, or an
+// evsig_process_shutdown_signal attached with exit_process).
+//
+// While set, unwinding skips UNWIND_CLASS_MEMORY actions and closes
+// UNWIND_CLASS_FD fds in bulk. Everything else still runs, so locks are
+// released and data is flushed. Scopes that exit normally run their actions
+// as usual.
+extern _Atomic bool unwind_fast_exit;
+
 // Must be called before using unwind system
 //
 // You must also call unwind_cleanup() when done.
@@ -73,12 +128,36 @@ void unwind_all();
 
 void _unwind(unwind_return_point* p);
 void _unwind_action(on_unwind_handler h, void* userdata);
+void _unwind_value_action(on_unwind_value_handler h, unwind_value value);
+void _unwind_action_class(on_unwind_handler h, void* userdata, uint8_t cls);
+void _unwind_value_action_class(on_unwind_value_handler h, unwind_value value, uint8_t cls);
 void unwind_run_handler(unwind_handler_stack_entry* e); // TODO only works with last one
+void unwind_run_top_handler(char* unused);
+void unwind_value_handler_close(unwind_value fd);
 void unwind_rm_handler(unwind_handler_stack_entry* e); // TODO only works with last one
 void unwind_handler_free(void* ptr);
 void unwind_handler_fclose(void* file);
 void unwind_handler_print(void* str);
 
+typedef void (*on_unwind_batch_handler)(void** items, uint64_t count);
+
+#define UNWIND_BATCH_INLINE_ITEMS 16
+
+// See UNWIND_ACTION_BATCH
+typedef struct {
+  on_unwind_batch_handler h;
+  void**   items;
+  uint64_t fill;
+  uint64_t alloc;
+  void*    inline_items[UNWIND_BATCH_INLINE_ITEMS];
+} unwind_batch;
+
+void _unwind_batch_init(unwind_batch* b, on_unwind_batch_handler h);
+void _unwind_handler_batch(void* batch);
+void unwind_batch_add(unwind_batch* b, void* item);
+void unwind_batch_handler_free(void** items, uint64_t count);
+void unwind_batch_handler_close(void** fds, uint64_t count);
+
 #define UNWIND(return_point) _unwind(return_point);
 
 #define UNWIND_ACTION(handler, _userdata) \
@@ -86,6 +165,50 @@ void unwind_handler_print(void* str);
   __attribute__((__cleanup__(unwind_run_handler))) \
   unwind_handler_stack_entry GENSYM(unwind_action) = { .h = handler, .userdata = _userdata };
 
+// Like UNWIND_ACTION, but value (any type of up to 8 bytes, such as an fd
+// or an id) is copied into the unwind entry instead of passing a pointer to
+// it. Nothing of the caller's has its address taken, so value can live in a
+// register.
+//
+// The handler takes an unwind_value. Get the value back with
+// UNWIND_VALUE_AS:
+//
+//   void close_fd(unwind_value v) { close(UNWIND_VALUE_AS(v, int)); }
+//
+//   int fd = sw_open(...);
+//   UNWIND_VALUE_ACTION(close_fd, fd); // or unwind_value_handler_close
+#define UNWIND_VALUE_ACTION(handler, value) \
+  _unwind_value_action(handler, UNWIND_VALUE(value)); \
+  __attribute__((__cleanup__(unwind_run_top_handler))) \
+  char GENSYM(unwind_action);
+
+// UNWIND_ACTION with an explicit UNWIND_CLASS_*
+#define UNWIND_ACTION_CLASS(cls, handler, _userdata) \
+  _unwind_action_class(handler, _userdata, cls); \
+  __attribute__((__cleanup__(unwind_run_top_handler))) \
+  char GENSYM(unwind_action);
+
+// UNWIND_VALUE_ACTION with an explicit UNWIND_CLASS_*
+#define UNWIND_VALUE_ACTION_CLASS(cls, handler, value) \
+  _unwind_value_action_class(handler, UNWIND_VALUE(value), cls); \
+  __attribute__((__cleanup__(unwind_run_top_handler))) \
+  char GENSYM(unwind_action);
+
+#define UNWIND_VALUE(value) ({ \
+    typeof(value) _unwind_value_in = (value); \
+    _Static_assert(sizeof(_unwind_value_in) <= sizeof(unwind_value), \
+                   "UNWIND_VALUE_ACTION values must be at most 8 bytes"); \
+    unwind_value _unwind_value_out = {0}; \
+    __builtin_memcpy(&_unwind_value_out, &_unwind_value_in, sizeof(_unwind_value_in)); \
+    _unwind_value_out; \
+  })
+
+#define UNWIND_VALUE_AS(v, type) ({ \
+    type _unwind_value_as; \
+    __builtin_memcpy(&_unwind_value_as, (v).bytes, sizeof(type)); \
+    _unwind_value_as; \
+  })
+
 // This action only runs on a signal or explicit unwind. Under normal code flow, does not
 // trigger. Useful in constructors where you intend to return something you allocate,
 // but need to clean up on error.
@@ -94,6 +217,28 @@ void unwind_handler_print(void* str);
   __attribute__((__cleanup__(unwind_rm_handler))) \
   unwind_handler_stack_entry GENSYM(unwind_action) = { .h = handler, .userdata = _userdata };
 
+// Declares a batch named name that is released with one call to handler
+// at end of scope (or unwind), instead of one unwind action per item. Add
+// items with UNWIND_BATCH_ADD, which costs an array append.
+//
+// handler receives every item added, in the order added. For example, to
+// free a scope's allocations:
+//
+//   UNWIND_ACTION_BATCH(allocs, unwind_batch_handler_free);
+//   for (...) {
+//     void* p = sw_malloc(64);
+//     UNWIND_BATCH_ADD(allocs, p);
+//   }
+//
+// unwind_batch_handler_close takes fds (as (void*)(intptr_t)fd) and closes
+// contiguous runs with close_range.
+#define UNWIND_ACTION_BATCH(name, handler) \
+  unwind_batch name; \
+  _unwind_batch_init(&name, handler); \
+  UNWIND_ACTION(_unwind_handler_batch, &name);
+
+#define UNWIND_BATCH_ADD(name, item) unwind_batch_add(&name, (void*)(item))
+
 #define UNWIND_RETURN_POINT(p, code_that_might_unwind, handle_unwind_code) \
   { \
     unwind_return_point p; \
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "libevsig/alloc_profile.h"
+#include "libevsig/evsig_mutex.h"
+#include <stdlib.h>
+#include "libevsig/util.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <execinfo.h>
+
+// How often threads check whether profiling was started, in bytes. Up to this
+// much per thread goes unsampled right after evsig_alloc_profile_start.
+#define _OFF_RECHECK_BYTES (64*1024)
+
+#define _LIVE_EMPTY     ((uintptr_t)0)
+#define _LIVE_TOMBSTONE ((uintptr_t)1)
+#define _LIVE_BUSY      ((uintptr_t)2)
+#define _LIVE_PROBES    16
+
+// Counts are of samples. They're scaled to estimates when dumping (pprof does
+// this itself for heap_v2).
+typedef struct {
+  _Atomic uint64_t hash; // 0 if unused
+  uint32_t         depth;
+  void*            stack[EVSIG_ALLOC_PROFILE_MAX_DEPTH];
+  _Atomic uint64_t alloc_objs;
+  _Atomic uint64_t alloc_bytes;
+  _Atomic uint64_t live_objs;
+  _Atomic uint64_t live_bytes;
+} _bucket;
+
+// Only the owning thread adds buckets. A thread's table outlives it, and is
+// adopted by the next new thread.
+typedef struct _thread_profile {
+  struct _thread_profile* next;
+  _Atomic bool            owned;
+  _bucket                 buckets[EVSIG_ALLOC_PROFILE_BUCKETS];
+} _thread_profile;
+
+// Sampled allocations that haven't been freed yet, so sw_free can find them
+// from any thread
+typedef struct {
+  _Atomic uintptr_t ptr;
+  _bucket*          bucket;
+  uint64_t          size;
+} _live_slot;
+
+thread_local int64_t _evsig_alloc_profile_countdown = 0;
+
+static thread_local uint64_t         countdown_interval = 0;
+static thread_local uint64_t         rand_state         = 0;
+static thread_local _thread_profile* profile            = NULL;
+
+// Set once the thread gave up its table, so allocations from TLS destructors
+// that run later don't write into a table another thread may have adopted
+static thread_local bool             profile_disowned   = false;
+
+static _Atomic uint64_t sample_interval = 0;
+
+static _thread_profile* profiles = NULL;
+static evsig_mutex      profiles_mutex = 0;
+
+static _live_slot       live[EVSIG_ALLOC_PROFILE_LIVE_SLOTS];
+static _Atomic uint64_t live_count = 0;
+
+static pthread_key_t  profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+
+static void _disown_on_thread_exit(void* p) {
+  profile          = NULL;
+  profile_disowned = true;
+  _evsig_alloc_profile_countdown = INT64_MAX;
+  atomic_store(&((_thread_profile*)p)->owned, false);
+}
+
+static void _create_profile_key() {
+  if (pthread_key_create(&profile_key, _disown_on_thread_exit) != 0) {
+    fprintf(stderr, "Failed to create thread exit key for libevsig alloc profiler");
+    exit(1);
+  }
+}
+
+static _thread_profile* _profile_get() {
+  if (profile) return profile;
+
+  evsig_lock(&profiles_mutex);
+  for (_thread_profile* p = profiles; p; p = p->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&p->owned, &expected, true)) { profile = p; break; }
+  }
+
+  // Plain calloc: sw_calloc would profile itself
+  if (!profile && (profile = calloc(1, sizeof(_thread_profile)))) {
+    atomic_store(&profile->owned, true);
+    profile->next = profiles;
+    profiles = profile;
+  }
+  evsig_unlock(&profiles_mutex);
+
+  if (profile) {
+    pthread_once(&profile_key_once, _create_profile_key);
+    pthread_setspecific(profile_key, profile);
+  }
+
+  return profile;
+}
+
+// xorshift64
+static uint64_t _rand() {
+  if (!rand_state) rand_state = (evsig_time_ns() ^ ((uint64_t)gettid() << 32)) | 1;
+
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 7;
+  rand_state ^= rand_state << 17;
+  return rand_state;
+}
+
+// Exponentially distributed with the given mean, for Poisson sampling
+static int64_t _next_countdown(uint64_t interval) {
+  double u = ((_rand() >> 11) + 1) * (1.0/9007199254740993.0); // (0, 1]
+  double d = -log(u) * (double)interval;
+  return d > (double)INT64_MAX ? INT64_MAX : (int64_t)d + 1;
+}
+
+static uint64_t _hash_stack(void** stack, uint32_t depth) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (uint32_t i = 0; i < depth; i++) {
+    h ^= (uintptr_t)stack[i];
+    h *= 0x100000001b3ull;
+  }
+  return h ? h : 1;
+}
+
+static _bucket* _bucket_get(_thread_profile* p, void** stack, uint32_t depth) {
+  uint64_t h = _hash_stack(stack, depth);
+
+  for (uint64_t i = 0; i < EVSIG_ALLOC_PROFILE_BUCKETS; i++) {
+    _bucket* b = &p->buckets[(h+i) % EVSIG_ALLOC_PROFILE_BUCKETS];
+    uint64_t bh = atomic_load_explicit(&b->hash, memory_order_relaxed);
+
+    if (bh == h && b->depth == depth
+        && memcmp(b->stack, stack, sizeof(void*)*depth) == 0) return b;
+
+    if (bh == 0) {
+      b->depth = depth;
+      memcpy(b->stack, stack, sizeof(void*)*depth);
+
+      // Publish the stack to dumping threads
+      atomic_store_explicit(&b->hash, h, memory_order_release);
+      return b;
+    }
+  }
+
+  return NULL;
+}
+
+static uint64_t _hash_ptr(uintptr_t p) {
+  p ^= p >> 33;
+  p *= 0xff51afd7ed558ccdull;
+  p ^= p >> 33;
+  return p;
+}
+
+static void _live_insert(void* ptr, _bucket* b, uint64_t size) {
+  // A slot still holding ptr is from a sampled allocation freed without
+  // sw_free, whose address malloc has handed out again. It's gone, so stop
+  // counting it, rather than leave a duplicate that sw_free would find first.
+  _evsig_alloc_profile_free((uintptr_t)ptr);
+
+  uint64_t h = _hash_ptr((uintptr_t)ptr);
+
+  for (uint64_t i = 0; i < _LIVE_PROBES; i++) {
+    _live_slot* s = &live[(h+i) % EVSIG_ALLOC_PROFILE_LIVE_SLOTS];
+    uintptr_t v = atomic_load_explicit(&s->ptr, memory_order_relaxed);
+    if (v != _LIVE_EMPTY && v != _LIVE_TOMBSTONE) continue;
+    if (!atomic_compare_exchange_strong(&s->ptr, &v, _LIVE_BUSY)) continue;
+
+    s->bucket = b;
+    s->size   = size;
+    atomic_fetch_add_explicit(&live_count, 1, memory_order_relaxed);
+    atomic_store_explicit(&s->ptr, (uintptr_t)ptr, memory_order_release);
+    return;
+  }
+
+  // Table is crowded here. The allocation still counts toward totals, and
+  // stays live forever.
+}
+
+__attribute__((noinline))
+void _evsig_alloc_profile_sample(void* ptr, size_t size) {
+  if (profile_disowned) {
+    _evsig_alloc_profile_countdown = INT64_MAX;
+    return;
+  }
+
+  uint64_t interval = atomic_load_explicit(&sample_interval, memory_order_relaxed);
+
+  // Not profiling, or the countdown was drawn for another interval. Sampling
+  // now would bias toward this allocation.
+  if (interval != countdown_interval) {
+    countdown_interval = interval;
+    _evsig_alloc_profile_countdown = interval ? _next_countdown(interval) : _OFF_RECHECK_BYTES;
+    return;
+  }
+  if (!interval) {
+    _evsig_alloc_profile_countdown = _OFF_RECHECK_BYTES;
+    return;
+  }
+
+  _evsig_alloc_profile_countdown = _next_countdown(interval);
+
+  _thread_profile* p = _profile_get();
+  if (!p) return;
+
+  // Skip ourselves and the sw_* allocator
+  void* stack[EVSIG_ALLOC_PROFILE_MAX_DEPTH+2];
+  int n = backtrace(stack, EVSIG_ALLOC_PROFILE_MAX_DEPTH+2);
+  uint32_t depth = n > 2 ? n-2 : 0;
+
+  _bucket* b = _bucket_get(p, stack+2, depth);
+  if (!b) return;
+
+  atomic_fetch_add_explicit(&b->alloc_objs,  1,    memory_order_relaxed);
+  atomic_fetch_add_explicit(&b->alloc_bytes, size, memory_order_relaxed);
+  atomic_fetch_add_explicit(&b->live_objs,   1,    memory_order_relaxed);
+  atomic_fetch_add_explicit(&b->live_bytes,  size, memory_order_relaxed);
+
+  _live_insert(ptr, b, size);
+}
+
+void _evsig_alloc_profile_free(uintptr_t ptr) {
+  if (__builtin_expect(atomic_load_explicit(&live_count, memory_order_relaxed) == 0, 1)) return;
+
+  uint64_t h = _hash_ptr(ptr);
+
+  for (uint64_t i = 0; i < _LIVE_PROBES; i++) {
+    _live_slot* s = &live[(h+i) % EVSIG_ALLOC_PROFILE_LIVE_SLOTS];
+    uintptr_t v = atomic_load_explicit(&s->ptr, memory_order_acquire);
+    if (v == _LIVE_EMPTY) return;
+    if (v != ptr) continue;
+
+    // Read before releasing the slot, after which it may be reused
+    _bucket* b    = s->bucket;
+    uint64_t size = s->size;
+    if (!atomic_compare_exchange_strong(&s->ptr, &v, _LIVE_TOMBSTONE)) return;
+
+    atomic_fetch_sub_explicit(&live_count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&b->live_objs,  1,    memory_order_relaxed);
+    atomic_fetch_sub_explicit(&b->live_bytes, size, memory_order_relaxed);
+    return;
+  }
+}
+
+void evsig_alloc_profile_start(uint64_t interval) {
+  atomic_store(&sample_interval, interval ? interval : EVSIG_ALLOC_PROFILE_DEFAULT_INTERVAL);
+}
+
+void evsig_alloc_profile_stop() {
+  atomic_store(&sample_interval, 0);
+}
+
+// Sampled counts to estimates, the same way pprof treats heap_v2 profiles
+static void _scale(uint64_t objs, uint64_t bytes, uint64_t interval,
+                   uint64_t* objs_out, uint64_t* bytes_out) {
+  if (!objs || !interval) { *objs_out = objs; *bytes_out = bytes; return; }
+
+  double avg   = (double)bytes / (double)objs;
+  double scale = 1.0 / (1.0 - exp(-avg / (double)interval));
+  *objs_out  = (uint64_t)((double)objs  * scale);
+  *bytes_out = (uint64_t)((double)bytes * scale);
+}
+
+typedef struct {
+  _bucket* b;
+  uint64_t live_objs, live_bytes, alloc_objs, alloc_bytes;
+} _dump_entry;
+
+static int _cmp_alloc_bytes(const void* a, const void* b) {
+  uint64_t x = ((const _dump_entry*)a)->alloc_bytes, y = ((const _dump_entry*)b)->alloc_bytes;
+  return (x < y) - (x > y);
+}
+
+void evsig_alloc_profile_dump(FILE* f, evsig_alloc_profile_format format) {
+  uint64_t interval = atomic_load(&sample_interval);
+  if (!interval) interval = EVSIG_ALLOC_PROFILE_DEFAULT_INTERVAL;
+
+  // The list only grows at the head, so we can walk it unlocked from here
+  evsig_lock(&profiles_mutex);
+  _thread_profile* head = profiles;
+  evsig_unlock(&profiles_mutex);
+
+  uint64_t n = 0;
+  for (_thread_profile* p = head; p; p = p->next) {
+    for (uint64_t i = 0; i < EVSIG_ALLOC_PROFILE_BUCKETS; i++)
+      if (atomic_load_explicit(&p->buckets[i].hash, memory_order_acquire)) n++;
+  }
+
+  _dump_entry* entries = malloc(sizeof(_dump_entry)*(n ? n : 1));
+  if (!entries) {
+    fprintf(stderr, "Failed to allocate alloc profile dump. Exiting.\n");
+    exit(1);
+  }
+
+  // Buckets may have been added since we counted
+  uint64_t fill = 0;
+  _dump_entry total = {0};
+  for (_thread_profile* p = head; p; p = p->next) {
+    for (uint64_t i = 0; i < EVSIG_ALLOC_PROFILE_BUCKETS && fill < n; i++) {
+      _bucket* b = &p->buckets[i];
+      if (!atomic_load_explicit(&b->hash, memory_order_acquire)) continue;
+
+      _dump_entry e = {
+        .b           = b,
+        .live_objs   = atomic_load_explicit(&b->live_objs,   memory_order_relaxed),
+        .live_bytes  = atomic_load_explicit(&b->live_bytes,  memory_order_relaxed),
+        .alloc_objs  = atomic_load_explicit(&b->alloc_objs,  memory_order_relaxed),
+        .alloc_bytes = atomic_load_explicit(&b->alloc_bytes, memory_order_relaxed),
+      };
+
+      total.live_objs   += e.live_objs;
+      total.live_bytes  += e.live_bytes;
+      total.alloc_objs  += e.alloc_objs;
+      total.alloc_bytes += e.alloc_bytes;
+      entries[fill++] = e;
+    }
+  }
+
+  if (format == EVSIG_ALLOC_PROFILE_PPROF) {
+    fprintf(f, "heap profile: %" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64 "]"
+               " @ heap_v2/%" PRIu64 "\n",
+            total.live_objs, total.live_bytes, total.alloc_objs, total.alloc_bytes, interval);
+
+    for (uint64_t i = 0; i < fill; i++) {
+      _dump_entry* e = &entries[i];
+      fprintf(f, "%" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64 "] @",
+              e->live_objs, e->live_bytes, e->alloc_objs, e->alloc_bytes);
+      for (uint32_t j = 0; j < e->b->depth; j++) fprintf(f, " %p", e->b->stack[j]);
+      fprintf(f, "\n");
+    }
+
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+      char buf[4096];
+      size_t r;
+      while ((r = fread(buf, 1, sizeof(buf), maps)) > 0) fwrite(buf, 1, r, f);
+      fclose(maps);
+    }
+  } else {
+    for (uint64_t i = 0; i < fill; i++) {
+      _dump_entry* e = &entries[i];
+      _scale(e->live_objs,  e->live_bytes,  interval, &e->live_objs,  &e->live_bytes);
+      _scale(e->alloc_objs, e->alloc_bytes, interval, &e->alloc_objs, &e->alloc_bytes);
+    }
+    qsort(entries, fill, sizeof(_dump_entry), _cmp_alloc_bytes);
+
+    fprintf(f, "Allocation profile, estimated from one sample per %" PRIu64 " bytes\n\n",
+            interval);
+    for (uint64_t i = 0; i < fill; i++) {
+      _dump_entry* e = &entries[i];
+      fprintf(f, "live %" PRIu64 " bytes in %" PRIu64 " objects, total %" PRIu64
+                 " bytes in %" PRIu64 " objects\n",
+              e->live_bytes, e->live_objs, e->alloc_bytes, e->alloc_objs);
+
+      fflush(f);
+      backtrace_symbols_fd(e->b->stack, e->b->depth, fileno(f));
+      fprintf(f, "\n");
+    }
+  }
+
+  fflush(f);
+  free(entries);
+}
@@ -0,0 +1,148 @@
+#include "libevsig/arena.h"
+#include "libevsig/sigwrap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <threads.h>
+
+static thread_local evsig_arena_chunk* cache = NULL;
+static thread_local uint64_t           cache_fill = 0;
+
+static pthread_key_t  cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void _trim_on_thread_exit(void* unused) {
+  evsig_arena_cache_trim();
+}
+
+static void _create_cache_key() {
+  if (pthread_key_create(&cache_key, _trim_on_thread_exit) != 0) {
+    fprintf(stderr, "Failed to create thread exit key for libevsig arena cache");
+    exit(1);
+  }
+}
+
+void evsig_arena_cache_trim() {
+  while (cache) {
+    evsig_arena_chunk* next = cache->next;
+    sw_free(cache);
+    cache = next;
+  }
+  cache_fill = 0;
+}
+
+static evsig_arena_chunk* _chunk_new(uint64_t size) {
+  if (size == EVSIG_ARENA_DEFAULT_CHUNK_SIZE && cache) {
+    evsig_arena_chunk* c = cache;
+    cache = c->next;
+    cache_fill--;
+    return c;
+  }
+
+  evsig_arena_chunk* c = sw_malloc(sizeof(evsig_arena_chunk)+size);
+  if (c) c->size = size;
+  return c;
+}
+
+static void _chunk_free(evsig_arena_chunk* c) {
+  if (c->size == EVSIG_ARENA_DEFAULT_CHUNK_SIZE
+      && cache_fill < EVSIG_ARENA_CACHE_MAX_CHUNKS) {
+    if (!cache) {
+      pthread_once(&cache_key_once, _create_cache_key);
+
+      // Destructors only run for non-NULL values
+      pthread_setspecific(cache_key, (void*)1);
+    }
+
+    c->next = cache;
+    cache   = c;
+    cache_fill++;
+    return;
+  }
+
+  sw_free(c);
+}
+
+void evsig_arena_init(evsig_arena* a, uint64_t chunk_size) {
+  a->chunks     = NULL;
+  a->cur        = NULL;
+  a->end        = NULL;
+  a->chunk_size = chunk_size ? chunk_size : EVSIG_ARENA_DEFAULT_CHUNK_SIZE;
+}
+
+// size plus the chunk header and alignment slack doesn't fit in 64 bits. More
+// memory can't help, so no SIG_RESTART_RECLAIM_RETRY, and handlers only get to
+// continue or supply a value. SIG_RESTART_RETRY would fail the same way, so
+// it's treated as continuing.
+static void* _size_overflow(const void* site, uint64_t size) {
+  sig_resume_state state = {0};
+  intptr_t value = 0;
+  const char* r = _sig_send_resumable(&state, site, SIGNAL_ALLOC_FAILED,
+                                      "Arena allocation size overflows", &size, NULL, &value);
+
+  return r == SIG_RESTART_USE_VALUE ? (void*)value : NULL;
+}
+
+void* evsig_arena_alloc_aligned(evsig_arena* a, uint64_t size, uint64_t align) {
+  if (size > UINT64_MAX - sizeof(evsig_arena_chunk) - align)
+    return _size_overflow(__builtin_return_address(0), size);
+
+  // Compared by what's left, so p + size can't wrap
+  uintptr_t p = ((uintptr_t)a->cur + (align-1)) & ~(uintptr_t)(align-1);
+  if (a->cur && p <= (uintptr_t)a->end && size <= (uintptr_t)a->end - p) {
+    a->cur = (unsigned char*)(p + size);
+    return (void*)p;
+  }
+
+  // Big allocations get their own chunk, kept behind the current one so we
+  // don't waste what's left of it
+  uint64_t need = size + (align > 16 ? align : 0);
+  if (need > a->chunk_size/4) {
+    evsig_arena_chunk* c = _chunk_new(need);
+    if (!c) return NULL;
+
+    if (a->chunks) {
+      c->next = a->chunks->next;
+      a->chunks->next = c;
+    } else {
+      c->next   = NULL;
+      a->chunks = c;
+      a->cur    = a->end = c->data + c->size; // Full
+    }
+
+    return (void*)(((uintptr_t)c->data + (align-1)) & ~(uintptr_t)(align-1));
+  }
+
+  evsig_arena_chunk* c = _chunk_new(a->chunk_size);
+  if (!c) return NULL;
+
+  c->next   = a->chunks;
+  a->chunks = c;
+  a->cur    = c->data;
+  a->end    = c->data + c->size;
+
+  p = ((uintptr_t)a->cur + (align-1)) & ~(uintptr_t)(align-1);
+  a->cur = (unsigned char*)(p + size);
+  return (void*)p;
+}
+
+void* evsig_arena_alloc(evsig_arena* a, uint64_t size) {
+  return evsig_arena_alloc_aligned(a, size, 16);
+}
+
+void evsig_arena_release(evsig_arena* a) {
+  evsig_arena_chunk* c = a->chunks;
+  while (c) {
+    evsig_arena_chunk* next = c->next;
+    _chunk_free(c);
+    c = next;
+  }
+
+  a->chunks = NULL;
+  a->cur    = NULL;
+  a->end    = NULL;
+}
+
+void _unwind_handler_arena_release(void* arena) {
+  evsig_arena_release(arena);
+}
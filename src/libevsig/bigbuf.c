@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include "libevsig/bigbuf.h"
+#include "libevsig/sigwrap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+SIG_DEFTYPE(SIGNAL_BIGBUF_NO_HUGETLB);
+SIG_DEFTYPE(SIGNAL_BIGBUF_NO_THP);
+SIG_DEFTYPE(SIG_RESTART_BIGBUF_REJECT);
+
+static uint64_t       huge_page_size = 2*1024*1024;
+static bool           thp_enabled    = false;
+static pthread_once_t probe_once     = PTHREAD_ONCE_INIT;
+
+static void _probe() {
+  FILE* f = fopen("/proc/meminfo", "r");
+  if (f) {
+    char line[256];
+    uint64_t kb;
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) { huge_page_size = kb*1024; break; }
+    }
+    fclose(f);
+  }
+
+  // "always [madvise] never". Missing means the kernel has no THP.
+  f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (f) {
+    char line[256] = {0};
+    if (fgets(line, sizeof(line), f)) thp_enabled = !strstr(line, "[never]");
+    fclose(f);
+  }
+}
+
+uint64_t evsig_huge_page_size() {
+  pthread_once(&probe_once, _probe);
+  return huge_page_size;
+}
+
+// Returns false if the handler rejected the fallback
+static bool _fallback(const void* site, const char* sig_type, const char* msg,
+                      evsig_bigbuf* b) {
+  if (!sig_has_handler(sig_type)) return true;
+
+  sig_resume_state state = { .extra_restart = SIG_RESTART_BIGBUF_REJECT };
+  const char* r = _sig_send_resumable(&state, site, sig_type, msg, b, NULL, NULL);
+  return r != SIG_RESTART_BIGBUF_REJECT;
+}
+
+static void _populate(void* addr, uint64_t size) {
+  if (madvise(addr, size, MADV_POPULATE_WRITE) == 0) return;
+
+  // Kernels before 5.14
+  long page = sysconf(_SC_PAGESIZE);
+  for (uint64_t i = 0; i < size; i += page) ((volatile char*)addr)[i] = 0;
+}
+
+void* evsig_bigbuf_alloc(evsig_bigbuf* b, uint64_t size, uint32_t flags) {
+  uint64_t huge = evsig_huge_page_size();
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  bool populate = flags & EVSIG_BIGBUF_POPULATE;
+
+  b->data     = NULL;
+  b->size     = size;
+  b->map_size = 0;
+  b->backing  = EVSIG_BIGBUF_NONE;
+
+  if (size >= huge) {
+    uint64_t map_size = (size + huge-1) & ~(huge-1);
+
+    // Not sw_mmap: failing here is expected whenever no huge pages are
+    // reserved, and isn't an error
+    void* p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (populate ? MAP_POPULATE : 0),
+                   -1, 0);
+    if (p != MAP_FAILED) {
+      b->data     = p;
+      b->map_size = map_size;
+      b->backing  = EVSIG_BIGBUF_HUGETLB;
+      return p;
+    }
+
+    if (!_fallback(__builtin_return_address(0), SIGNAL_BIGBUF_NO_HUGETLB,
+                   "No explicit huge pages available, falling back to transparent huge pages", b))
+      return NULL;
+
+    if (thp_enabled) {
+      // Over-map by a huge page, then trim to an aligned range, so every
+      // huge-page-sized piece can be backed by one. Not sw_mmap either:
+      // failing only means no THP, as normal pages may still fit without the
+      // extra huge page.
+      void* raw = mmap(NULL, map_size + huge, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (raw != MAP_FAILED) {
+        uintptr_t start   = ((uintptr_t)raw + huge-1) & ~(uintptr_t)(huge-1);
+        uint64_t  head    = start - (uintptr_t)raw;
+        uint64_t  tail    = huge - head;
+        if (head) munmap(raw, head);
+        if (tail) munmap((void*)(start + map_size), tail);
+
+        if (madvise((void*)start, map_size, MADV_HUGEPAGE) == 0) {
+          // After madvise, so faults get huge pages
+          if (populate) _populate((void*)start, map_size);
+
+          b->data     = (void*)start;
+          b->map_size = map_size;
+          b->backing  = EVSIG_BIGBUF_THP;
+          return b->data;
+        }
+
+        munmap((void*)start, map_size);
+      }
+    }
+
+    if (!_fallback(__builtin_return_address(0), SIGNAL_BIGBUF_NO_THP,
+                   "No transparent huge pages available, falling back to normal pages", b))
+      return NULL;
+  }
+
+  uint64_t map_size = (size + page-1) & ~(page-1);
+  void* p = sw_mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0), -1, 0);
+  if (p == MAP_FAILED || !p) return NULL;
+
+  b->data     = p;
+  b->map_size = map_size;
+  b->backing  = EVSIG_BIGBUF_PAGES;
+  return p;
+}
+
+void evsig_bigbuf_free(evsig_bigbuf* b) {
+  if (!b) return;
+  if (b->data) munmap(b->data, b->map_size);
+  b->data     = NULL;
+  b->map_size = 0;
+  b->backing  = EVSIG_BIGBUF_NONE;
+}
+
+void _unwind_handler_bigbuf_free(void* b) {
+  evsig_bigbuf_free(b);
+}
@@ -0,0 +1,272 @@
+#include "libevsig/memory.h"
+#include "libevsig/evsig_mutex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <threads.h>
+#include <sched.h>
+
+SIG_DEFTYPE(SIG_RESTART_RECLAIM_RETRY);
+SIG_DEFTYPE(SIGNAL_MEMORY_BUDGET_EXCEEDED);
+
+thread_local uint64_t           evsig_memory_allocated = 0;
+thread_local uint64_t           evsig_memory_limit     = UINT64_MAX;
+thread_local sig_memory_budget* sig_memory_budget_top  = NULL;
+
+typedef struct {
+  evsig_reclaimer fn;
+  void*           userdata;
+  int32_t         priority;
+  uint64_t        id;
+} _reclaimer;
+
+// Fixed size, so reclaiming never needs to allocate
+static _reclaimer  reclaimers[EVSIG_RECLAIMERS_MAX];
+static uint64_t    reclaimers_fill = 0;
+static uint64_t    reclaimers_next_id = 1;
+static evsig_mutex reclaimers_mutex = 0;
+
+static thread_local bool in_reclaim = false;
+
+// evsig_reclaim calls working from a snapshot, which unregister waits out
+static _Atomic uint64_t reclaims_inflight = 0;
+
+static void* _Atomic     reserve      = NULL;
+static _Atomic uint64_t  reserve_size = EVSIG_MEMORY_DEFAULT_RESERVE;
+static pthread_once_t    reserve_once = PTHREAD_ONCE_INIT;
+
+// Set when the reserve was given up, until it's set aside again
+_Atomic bool _evsig_reserve_spent = false;
+
+uint64_t evsig_reclaimer_register(evsig_reclaimer fn, void* userdata, int32_t priority) {
+  evsig_lock(&reclaimers_mutex);
+
+  if (reclaimers_fill == EVSIG_RECLAIMERS_MAX) {
+    fprintf(stderr, "More than EVSIG_RECLAIMERS_MAX reclaimers registered. Exiting.\n");
+    exit(1);
+  }
+
+  // Insert after those of equal priority, so registration order breaks ties
+  uint64_t i = reclaimers_fill;
+  while (i > 0 && reclaimers[i-1].priority > priority) {
+    reclaimers[i] = reclaimers[i-1];
+    i--;
+  }
+
+  uint64_t id = reclaimers_next_id++;
+  reclaimers[i] = (_reclaimer){ .fn = fn, .userdata = userdata, .priority = priority, .id = id };
+  reclaimers_fill++;
+
+  evsig_unlock(&reclaimers_mutex);
+  return id;
+}
+
+void evsig_reclaimer_unregister(uint64_t id) {
+  evsig_lock(&reclaimers_mutex);
+
+  for (uint64_t i = 0; i < reclaimers_fill; i++) {
+    if (reclaimers[i].id == id) {
+      memmove(&reclaimers[i], &reclaimers[i+1], sizeof(_reclaimer)*(reclaimers_fill-i-1));
+      reclaimers_fill--;
+      break;
+    }
+  }
+
+  evsig_unlock(&reclaimers_mutex);
+
+  // Reclaims in progress may still call it from their snapshot. A reclaimer
+  // unregistering itself can't wait for them, as it's one of them.
+  if (in_reclaim) return;
+  while (atomic_load(&reclaims_inflight)) sched_yield();
+}
+
+static void _unwind_handler_reclaim_done(void* ud) {
+  atomic_fetch_sub(&reclaims_inflight, 1);
+  in_reclaim = false;
+}
+
+uint64_t evsig_reclaim(uint64_t want) {
+  if (in_reclaim) return 0;
+  in_reclaim = true;
+
+  // Reclaimers run without the lock held, so they can take their own locks
+  // (and unregister) without deadlocking against us
+  _reclaimer snapshot[EVSIG_RECLAIMERS_MAX];
+  evsig_lock(&reclaimers_mutex);
+  uint64_t n = reclaimers_fill;
+  memcpy(snapshot, reclaimers, sizeof(_reclaimer)*n);
+  atomic_fetch_add(&reclaims_inflight, 1);
+  evsig_unlock(&reclaimers_mutex);
+
+  // Also if a reclaimer unwinds, or unregister would wait forever
+  UNWIND_ACTION(_unwind_handler_reclaim_done, NULL);
+
+  uint64_t freed = 0;
+  for (uint64_t i = 0; i < n && freed < want; i++) {
+    freed += snapshot[i].fn(want - freed, snapshot[i].userdata);
+  }
+
+  return freed;
+}
+
+static void* _reserve_alloc(uint64_t bytes) {
+  if (!bytes) return NULL;
+
+  // Touch it, so the pages are really ours and not just overcommitted
+  void* r = malloc(bytes);
+  if (r) memset(r, 0, bytes);
+  return r;
+}
+
+static void _reserve_arm() {
+  // Cleared first, so a failure freeing the reserve after our check still
+  // leaves it marked spent
+  atomic_store(&_evsig_reserve_spent, false);
+  if (atomic_load(&reserve)) return;
+
+  uint64_t bytes = atomic_load(&reserve_size);
+  void* r = _reserve_alloc(bytes);
+  if (!r) {
+    // Next successful allocation tries again
+    if (bytes) atomic_store(&_evsig_reserve_spent, true);
+    return;
+  }
+
+  void* expected = NULL;
+  if (!atomic_compare_exchange_strong(&reserve, &expected, r)) free(r);
+}
+
+void evsig_memory_reserve(uint64_t bytes) {
+  atomic_store(&reserve_size, bytes);
+  free(atomic_exchange(&reserve, NULL));
+  _reserve_arm();
+}
+
+static void _reserve_default() {
+  _reserve_arm();
+}
+
+void _evsig_memory_init() {
+  pthread_once(&reserve_once, _reserve_default);
+}
+
+bool _evsig_alloc_failed(sig_resume_state* state, const void* site, size_t size,
+                         intptr_t* value_out) {
+  atomic_store(&_evsig_reserve_spent, true);
+  free(atomic_exchange(&reserve, NULL));
+
+  while (true) {
+    const char* r = _sig_send_resumable(state, site, SIGNAL_ALLOC_FAILED,
+                                        "Memory allocation failed", &size, NULL, value_out);
+
+    if (r == SIG_RESTART_RETRY) return true;
+    if (r != SIG_RESTART_RECLAIM_RETRY) return false;
+    if (evsig_reclaim(size) > 0) return true;
+
+    // Nothing to reclaim. Send again without offering it, so the handlers
+    // behind the reclaim handler (and the catch-all) decide, rather than the
+    // allocation failing without anyone being told.
+    state->extra_restart = NULL;
+  }
+}
+
+void _evsig_alloc_recovered() {
+  // Handlers allocating out of the reserve we just freed for them
+  if (sig_resume_top && sig_resume_top->sig_type == SIGNAL_ALLOC_FAILED) return;
+
+  _reserve_arm();
+}
+
+const char* sig_reclaim_handler(const char* sig_type, void* userdata, const char* msg, void* signal_data) {
+  if (_sig_restart_available(sig_type, SIG_RESTART_RECLAIM_RETRY))
+    return SIG_RESTART_RECLAIM_RETRY;
+  return SIG_RESTART_NULL;
+}
+
+static uint64_t _budget_limit(const sig_memory_budget* b) {
+  return (b->bytes > UINT64_MAX - b->start) ? UINT64_MAX : b->start + b->bytes;
+}
+
+// Keeps evsig_memory_limit >= evsig_memory_allocated, so the fast path can
+// subtract without overflowing
+static void _update_limit() {
+  uint64_t limit = UINT64_MAX;
+  for (sig_memory_budget* b = sig_memory_budget_top; b; b = b->prev) {
+    if (b->waived) continue;
+
+    uint64_t l = _budget_limit(b);
+    if (l < limit) limit = l;
+  }
+
+  evsig_memory_limit = (limit < evsig_memory_allocated) ? evsig_memory_allocated : limit;
+}
+
+void _sig_memory_budget_push(sig_memory_budget* b, uint64_t bytes) {
+  b->bytes  = bytes;
+  b->start  = evsig_memory_allocated;
+  b->waived = false;
+  b->prev   = sig_memory_budget_top;
+  sig_memory_budget_top = b;
+  _update_limit();
+}
+
+void _unwind_handler_sig_memory_budget_pop(void* b) {
+  sig_memory_budget_top = ((sig_memory_budget*)b)->prev;
+  _update_limit();
+}
+
+void _evsig_budget_refund(size_t size) {
+  evsig_memory_allocated -= (size < evsig_memory_allocated) ? size : evsig_memory_allocated;
+  _update_limit();
+}
+
+uint64_t sig_memory_budget_used(const sig_memory_budget* b) {
+  return evsig_memory_allocated - b->start;
+}
+
+bool _evsig_budget_exceeded(const void* site, size_t size, intptr_t* value_out) {
+  // Handlers allocating while we're signalling aren't limited. Checked through
+  // the resume frame, which is popped even if the handler unwinds.
+  if (sig_resume_top && sig_resume_top->sig_type == SIGNAL_MEMORY_BUDGET_EXCEEDED) {
+    evsig_memory_allocated += size;
+    _update_limit();
+    return true;
+  }
+
+  sig_resume_state state = {0};
+  while (true) {
+    uint64_t after = (size > UINT64_MAX - evsig_memory_allocated)
+      ? UINT64_MAX : evsig_memory_allocated + size;
+
+    // Innermost scope this would exceed
+    sig_memory_budget* exceeded = NULL;
+    for (sig_memory_budget* b = sig_memory_budget_top; b; b = b->prev) {
+      if (!b->waived && after > _budget_limit(b)) { exceeded = b; break; }
+    }
+
+    if (!exceeded) {
+      evsig_memory_allocated = after;
+      _update_limit();
+      return true;
+    }
+
+    const char* r = _sig_send_resumable(&state, site, SIGNAL_MEMORY_BUDGET_EXCEEDED,
+                                        "Memory budget exceeded", exceeded, NULL, value_out);
+
+    if (r == SIG_RESTART_RETRY) {
+      _update_limit();
+      continue;
+    }
+
+    if (r == SIG_RESTART_CONTINUE) {
+      for (sig_memory_budget* b = sig_memory_budget_top; b; b = b->prev) {
+        if (after > _budget_limit(b)) b->waived = true;
+      }
+      continue;
+    }
+
+    if (r != SIG_RESTART_USE_VALUE) *value_out = 0;
+    return false;
+  }
+}
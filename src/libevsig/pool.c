@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include "libevsig/pool.h"
+#include "libevsig/sigwrap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+SIG_DEFTYPE(SIGNAL_POOL_EXHAUSTED);
+SIG_DEFTYPE(SIG_RESTART_POOL_GROW);
+
+// From linux/mempolicy.h, so we don't need libnuma
+#define _MPOL_LOCAL 4
+
+// From linux/mman.h, missing from older libc headers
+#ifdef MADV_POPULATE_WRITE
+#define _MADV_POPULATE_WRITE MADV_POPULATE_WRITE
+#else
+#define _MADV_POPULATE_WRITE 23
+#endif
+
+typedef struct {
+  evsig_pool*      pool;
+  evsig_pool_node* head;
+  uint64_t         count;
+} _thread_cache;
+
+static thread_local _thread_cache caches[EVSIG_POOL_THREAD_CACHES];
+static thread_local uint64_t      cache_next_victim = 0;
+
+static pthread_key_t  cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void _flush_all_on_thread_exit(void* unused);
+
+static void _create_cache_key() {
+  if (pthread_key_create(&cache_key, _flush_all_on_thread_exit) != 0) {
+    fprintf(stderr, "Failed to create thread exit key for libevsig pool cache");
+    exit(1);
+  }
+}
+
+// Pushes the chain first..last onto the global free list
+static void _global_push(evsig_pool* p, evsig_pool_node* first, evsig_pool_node* last) {
+  evsig_pool_node* head = atomic_load_explicit(&p->global_free, memory_order_relaxed);
+  do {
+    last->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&p->global_free, &head, first,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+}
+
+static void _cache_flush(_thread_cache* c) {
+  if (c->head) {
+    evsig_pool_node* last = c->head;
+    while (last->next) last = last->next;
+    _global_push(c->pool, c->head, last);
+  }
+
+  c->pool  = NULL;
+  c->head  = NULL;
+  c->count = 0;
+}
+
+static void _flush_all_on_thread_exit(void* unused) {
+  for (uint64_t i = 0; i < EVSIG_POOL_THREAD_CACHES; i++) {
+    if (caches[i].pool) _cache_flush(&caches[i]);
+  }
+}
+
+static _thread_cache* _cache_find(evsig_pool* p) {
+  for (uint64_t i = 0; i < EVSIG_POOL_THREAD_CACHES; i++) {
+    if (caches[i].pool == p) return &caches[i];
+  }
+  return NULL;
+}
+
+static _thread_cache* _cache_get(evsig_pool* p) {
+  _thread_cache* c = _cache_find(p);
+  if (c) return c;
+
+  for (uint64_t i = 0; i < EVSIG_POOL_THREAD_CACHES; i++) {
+    if (!caches[i].pool) { c = &caches[i]; break; }
+  }
+
+  if (!c) {
+    c = &caches[cache_next_victim];
+    cache_next_victim = (cache_next_victim+1) % EVSIG_POOL_THREAD_CACHES;
+    _cache_flush(c);
+  }
+
+  pthread_once(&cache_key_once, _create_cache_key);
+
+  // Destructors only run for non-NULL values
+  pthread_setspecific(cache_key, (void*)1);
+
+  c->pool = p;
+  return c;
+}
+
+// Takes the whole global free list at once. Popping single nodes would be
+// subject to ABA, taking everything isn't.
+static bool _cache_refill(_thread_cache* c) {
+  evsig_pool_node* head = atomic_exchange_explicit(&c->pool->global_free, NULL,
+                                                   memory_order_acquire);
+  if (!head) return false;
+
+  uint64_t n = 0;
+  for (evsig_pool_node* i = head; i; i = i->next) n++;
+
+  c->head  = head;
+  c->count = n;
+  return true;
+}
+
+// Carves a new slab into c. Returns false if the pool is at max_objects.
+typedef enum {
+  _GROW_OK,
+  _GROW_AT_LIMIT,  // max_objects reached
+  _GROW_MAP_FAILED // sw_mmap already signalled, and a handler continued
+} _grow_result;
+
+// Faults in every page of the slab from this thread, so MPOL_LOCAL places them
+// on our node
+static void _prefault(void* addr, uint64_t size) {
+  if (madvise(addr, size, _MADV_POPULATE_WRITE) == 0) return;
+
+  // Kernels before 5.14
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  for (uint64_t off = 0; off < size; off += page) ((volatile unsigned char*)addr)[off] = 0;
+}
+
+static _grow_result _cache_grow(evsig_pool* p) {
+
+  // Reserve our objects up front so concurrent growers can't overshoot the cap
+  uint64_t n;
+  uint64_t carved = atomic_load(&p->carved);
+  do {
+    n = p->objs_per_slab;
+    uint64_t max = atomic_load(&p->max_objects);
+    if (max) {
+      if (carved >= max) return _GROW_AT_LIMIT;
+      if (max - carved < n) n = max - carved;
+    }
+  } while (!atomic_compare_exchange_weak(&p->carved, &carved, carved+n));
+
+  uint64_t size = sizeof(evsig_pool_slab) + n*p->obj_size;
+
+  // No MAP_POPULATE with numa_local: pages have to be bound before they're
+  // faulted in, or they land wherever the first touch happens to allocate.
+  //
+  // SIG_RESTART_RETRY from a SIGNAL_ENOMEM handler retries the mmap
+  evsig_pool_slab* s = sw_mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (s == MAP_FAILED) {
+    atomic_fetch_sub(&p->carved, n);
+    return _GROW_MAP_FAILED;
+  }
+
+  if (p->numa_local) {
+    // Fails on kernels without NUMA support, where it doesn't matter
+    syscall(SYS_mbind, s, size, _MPOL_LOCAL, NULL, 0, 0);
+    _prefault(s, size);
+  }
+
+  s->size = size;
+
+  // An mmap error handler may have used another pool and evicted ours
+  _thread_cache* c = _cache_get(p);
+
+  unsigned char* objs = (unsigned char*)(s+1);
+  for (uint64_t i = 0; i < n; i++) {
+    evsig_pool_node* node = (evsig_pool_node*)(objs + i*p->obj_size);
+    node->next = c->head;
+    c->head = node;
+  }
+  c->count += n;
+
+  evsig_lock(&p->slab_mutex);
+  s->next = p->slabs;
+  p->slabs = s;
+  evsig_unlock(&p->slab_mutex);
+
+  return _GROW_OK;
+}
+
+void evsig_pool_init(evsig_pool* p, uint64_t obj_size, uint64_t max_objects, bool numa_local) {
+  if (obj_size < sizeof(evsig_pool_node)) obj_size = sizeof(evsig_pool_node);
+  obj_size = (obj_size + 15) & ~(uint64_t)15;
+
+  p->obj_size      = obj_size;
+  p->objs_per_slab = (EVSIG_POOL_SLAB_SIZE - sizeof(evsig_pool_slab)) / obj_size;
+  if (p->objs_per_slab == 0) p->objs_per_slab = 1;
+  p->numa_local    = numa_local;
+  p->slabs         = NULL;
+  p->slab_mutex    = 0;
+
+  atomic_store(&p->carved, 0);
+  atomic_store(&p->max_objects, max_objects);
+  atomic_store(&p->global_free, NULL);
+}
+
+void evsig_pool_destroy(evsig_pool* p) {
+  _thread_cache* c = _cache_find(p);
+  if (c) {
+    c->pool  = NULL;
+    c->head  = NULL;
+    c->count = 0;
+  }
+
+  evsig_pool_slab* s = p->slabs;
+  while (s) {
+    evsig_pool_slab* next = s->next;
+    munmap(s, s->size);
+    s = next;
+  }
+
+  p->slabs = NULL;
+  atomic_store(&p->carved, 0);
+  atomic_store(&p->global_free, NULL);
+}
+
+void* evsig_pool_alloc(evsig_pool* p) {
+  _thread_cache* c = _cache_get(p);
+
+  sig_resume_state state = { .extra_restart = SIG_RESTART_POOL_GROW };
+  while (!c->head && !_cache_refill(c)) {
+    _grow_result g = _cache_grow(p);
+    if (g == _GROW_OK) {
+      c = _cache_get(p);
+      break;
+    }
+
+    // Out of memory rather than out of objects, and the mmap error handler
+    // already chose to continue
+    if (g == _GROW_MAP_FAILED) return NULL;
+
+    intptr_t value;
+    const char* r = _sig_send_resumable(&state, __builtin_return_address(0),
+                                        SIGNAL_POOL_EXHAUSTED,
+                                        "Object pool exhausted", p, NULL, &value);
+
+    if (r == SIG_RESTART_POOL_GROW) {
+      atomic_fetch_add(&p->max_objects, p->objs_per_slab);
+    } else if (r == SIG_RESTART_USE_VALUE) {
+      return (void*)value;
+    } else if (r != SIG_RESTART_RETRY) {
+      return NULL;
+    }
+
+    // A handler may have used another pool and evicted ours
+    c = _cache_get(p);
+  }
+
+  evsig_pool_node* node = c->head;
+  c->head = node->next;
+  c->count--;
+  return node;
+}
+
+void evsig_pool_free(evsig_pool* p, void* obj) {
+  if (!obj) return;
+
+  _thread_cache* c = _cache_get(p);
+  evsig_pool_node* node = obj;
+  node->next = c->head;
+  c->head = node;
+  c->count++;
+
+  if (c->count > EVSIG_POOL_CACHE_MAX) {
+    // Keep half, so alternating alloc/free doesn't bounce off the global list
+    evsig_pool_node* last = c->head;
+    for (uint64_t i = 1; i < EVSIG_POOL_CACHE_MAX/2; i++) last = last->next;
+
+    evsig_pool_node* first = last->next;
+    last->next = NULL;
+    c->count = EVSIG_POOL_CACHE_MAX/2;
+
+    last = first;
+    while (last->next) last = last->next;
+    _global_push(p, first, last);
+  }
+}
+
+void evsig_pool_thread_flush(evsig_pool* p) {
+  _thread_cache* c = _cache_find(p);
+  if (c) _cache_flush(c);
+}
+
+void _unwind_handler_pool_free(void* ref) {
+  _evsig_pool_ref* r = ref;
+  evsig_pool_free(r->pool, r->obj);
+}
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE // Needed for gettid() and tgkill()
+#include "libevsig/process_shutdown_signal.h"
+#include "libevsig/thread_shutdown_signal.h"
+#include "libevsig/unwind.h"
+#include "libevsig/evsig_mutex.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include "libevsig/util.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// How often a waiting send wakes up to check for dead threads
+#define PRUNE_INTERVAL_MS 20
+
+typedef struct {
+  evsig_process_shutdown_signal* s;
+  bool exit_process;
+  _Atomic bool registered;
+} attach_args;
+
+// The signal this process is attached to. Reset in forked children, which
+// don't inherit the watcher thread.
+static evsig_process_shutdown_signal* attached = NULL;
+static evsig_mutex                    attach_mutex = 0;
+static pthread_once_t                 atfork_once = PTHREAD_ONCE_INIT;
+
+// Not FUTEX_PRIVATE_FLAG, as these words live in memory shared between
+// processes.
+static void _futex_wait(_Atomic uint32_t* word, uint32_t val, uint64_t timeout_ms) {
+  struct timespec ts = { .tv_sec  = timeout_ms / 1000,
+                         .tv_nsec = (timeout_ms % 1000) * 1000000 };
+  (void)syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void _futex_wake(_Atomic uint32_t* word) {
+  (void)syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void _atfork_child() {
+  attached     = NULL;
+  attach_mutex = 0;
+}
+
+static void _atfork_init() {
+  pthread_atfork(NULL, NULL, _atfork_child);
+}
+
+// Call with mutex held
+static void _remove_thread_at(evsig_process_shutdown_signal* s, uint32_t i) {
+  uint32_t fill = atomic_load(&s->threads_fill);
+  s->threads[i] = s->threads[fill-1];
+  atomic_store(&s->threads_fill, fill-1);
+}
+
+// Removes threads that no longer exist. Call with mutex held.
+static void _prune_dead_threads(evsig_process_shutdown_signal* s) {
+  for (uint32_t i = 0; i < atomic_load(&s->threads_fill);) {
+    evsig_process_thread* t = s->threads+i;
+    if (tgkill(t->pid, t->tid, 0) == -1 && errno == ESRCH) {
+      _remove_thread_at(s, i);
+      continue;
+    }
+    i++;
+  }
+}
+
+void evsig_process_shutdown_signal_init(evsig_process_shutdown_signal* s) {
+  memset(s, 0, sizeof(*s));
+}
+
+bool evsig_process_shutdown_signal_register_thread(evsig_process_shutdown_signal* s,
+                                                   pid_t pid,
+                                                   pid_t tid) {
+  bool ret = true;
+
+  evsig_lock(&s->mutex);
+  do {
+    uint32_t fill = atomic_load(&s->threads_fill);
+
+    // Check for duplicates
+    bool duplicate = false;
+    for (uint32_t i = 0; i < fill; i++)
+      if (s->threads[i].pid == pid && s->threads[i].tid == tid) { duplicate = true; break; }
+    if (duplicate) break;
+
+    if (fill >= EVSIG_PROCESS_SHUTDOWN_SIGNAL_MAX_THREADS) { ret = false; break; }
+
+    s->threads[fill] = (evsig_process_thread){ .pid = pid, .tid = tid };
+    atomic_store(&s->threads_fill, fill+1);
+  } while (false);
+  evsig_unlock(&s->mutex);
+
+  return ret;
+}
+
+void evsig_process_shutdown_signal_confirm_shutdown(evsig_process_shutdown_signal* s,
+                                                    pid_t pid,
+                                                    pid_t tid) {
+  evsig_lock(&s->mutex);
+  for (uint32_t i = 0; i < atomic_load(&s->threads_fill); i++) {
+    if (s->threads[i].pid == pid && s->threads[i].tid == tid) {
+      _remove_thread_at(s, i);
+      break;
+    }
+  }
+  evsig_unlock(&s->mutex);
+
+  _futex_wake(&s->threads_fill);
+}
+
+bool evsig_process_shutdown_signal_send_block(evsig_process_shutdown_signal* s,
+                                              uint64_t timeout_ms) {
+  if (atomic_exchange(&s->shutdown, 1)) return false;
+  _futex_wake(&s->shutdown);
+
+  // Block until every thread has confirmed or timeout is elapsed
+  uint64_t start_ms = evsig_time_ms();
+  while (true) {
+    evsig_lock(&s->mutex);
+    _prune_dead_threads(s);
+    uint32_t fill = atomic_load(&s->threads_fill);
+    evsig_unlock(&s->mutex);
+
+    if (!fill) return false;
+
+    uint64_t elapsed = evsig_time_ms()-start_ms;
+    if (elapsed >= timeout_ms) return true;
+
+    uint64_t wait_ms = timeout_ms-elapsed;
+    if (wait_ms > PRUNE_INTERVAL_MS) wait_ms = PRUNE_INTERVAL_MS;
+    _futex_wait(&s->threads_fill, fill, wait_ms);
+  }
+}
+
+bool evsig_process_shutdown_signal_wait(evsig_process_shutdown_signal* s,
+                                        uint64_t timeout_ms) {
+  uint64_t start_ms = evsig_time_ms();
+  while (!atomic_load(&s->shutdown)) {
+    if (timeout_ms == UINT64_MAX) {
+      (void)syscall(SYS_futex, &s->shutdown, FUTEX_WAIT, 0, NULL, NULL, 0);
+      continue;
+    }
+
+    uint64_t elapsed = evsig_time_ms()-start_ms;
+    if (elapsed >= timeout_ms) return false;
+    _futex_wait(&s->shutdown, 0, timeout_ms-elapsed);
+  }
+
+  return true;
+}
+
+bool evsig_process_shutdown_p(evsig_process_shutdown_signal* s) {
+  return atomic_load(&s->shutdown);
+}
+
+static void* _watcher_thread(void* ud) {
+  attach_args* a = ud;
+  evsig_process_shutdown_signal* s = a->s;
+  bool exit_process = a->exit_process;
+
+  // Leave OS signals to the threads that asked for them
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  evsig_process_shutdown_signal_register_thread(s, getpid(), gettid());
+
+  // a lives on the attaching thread's stack, don't touch it after this
+  atomic_store(&a->registered, true);
+
+  evsig_process_shutdown_signal_wait(s, UINT64_MAX);
+  if (exit_process) atomic_store(&unwind_fast_exit, true);
+
+  evsig_thread_shutdown_signal* g = &evsig_global_thread_shutdown_signal;
+  evsig_lock(&g->master_mutex);
+  uint64_t timeout_ms = g->timeout_ms;
+  evsig_unlock(&g->master_mutex);
+
+  evsig_thread_shutdown_signal_send_block(g, timeout_ms);
+  evsig_process_shutdown_signal_confirm_shutdown(s, getpid(), gettid());
+
+  if (exit_process) exit(0);
+  return NULL;
+}
+
+void evsig_process_shutdown_signal_attach(evsig_process_shutdown_signal* s,
+                                          bool exit_process) {
+  pthread_once(&atfork_once, _atfork_init);
+
+  evsig_lock(&attach_mutex);
+  do {
+    if (attached == s) break;
+
+    attach_args args = { .s = s, .exit_process = exit_process, .registered = false };
+
+    pthread_t t;
+    int r = pthread_create(&t, NULL, _watcher_thread, &args);
+    if (r != 0) {
+      fprintf(stderr, "Failed to create libevsig process shutdown watcher\n");
+      exit(1);
+    }
+    pthread_detach(t); // So we don't need to join it
+
+    // Make sure a send right after we return waits for this process
+    while (!atomic_load(&args.registered)) evsig_sleep_ns(10000);
+
+    attached = s;
+  } while (false);
+  evsig_unlock(&attach_mutex);
+}
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE // Needed for gettid()
+#include "libevsig/retry_policy.h"
+#include "libevsig/signals.h"
+#include "libevsig/errno_signals.h"
+#include "libevsig/thread_signal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "libevsig/util.h"
+#include <unistd.h>
+
+const char* const sig_retry_transient_types[] = {
+  SIGNAL_EINTR,
+  SIGNAL_EBUSY,
+  SIGNAL_ENOBUFS,
+  SIGNAL_EHOSTUNREACH,
+  SIGNAL_ENETUNREACH,
+  SIGNAL_ENETDOWN,
+  NULL
+};
+
+static thread_local uint64_t jitter_state = 0;
+
+// xorshift64, plenty for jitter
+static uint64_t _jitter_rand() {
+  if (!jitter_state) jitter_state = (evsig_time_ns() ^ ((uint64_t)gettid() << 32)) | 1;
+
+  jitter_state ^= jitter_state << 13;
+  jitter_state ^= jitter_state >> 7;
+  jitter_state ^= jitter_state << 17;
+  return jitter_state;
+}
+
+static bool _should_retry(sig_retry_policy* p, const char* sig_type) {
+  const char* const* types = p->retry_on ? p->retry_on : sig_retry_transient_types;
+  for (; *types; types++) if (*types == sig_type) return true;
+  return false;
+}
+
+static uint64_t _delay_ns(sig_retry_policy* p, uint32_t attempt) {
+  uint64_t mult  = p->multiplier ? p->multiplier : 2;
+  uint64_t delay = p->base_delay_ns;
+
+  for (uint32_t i = 1; i < attempt; i++) {
+    if (p->max_delay_ns && delay >= p->max_delay_ns) break;
+    if (delay > UINT64_MAX/mult) { delay = UINT64_MAX; break; }
+    delay *= mult;
+  }
+  if (p->max_delay_ns && delay > p->max_delay_ns) delay = p->max_delay_ns;
+
+  uint32_t jitter = p->jitter_pct > 100 ? 100 : p->jitter_pct;
+  uint64_t range  = delay/100*jitter;
+  if (range) delay -= _jitter_rand() % range;
+
+  return delay;
+}
+
+const char* sig_retry_handler(const char* sig_type,
+                              void* userdata,
+                              const char* msg,
+                              void* signal_data) {
+  sig_retry_policy* p  = userdata;
+  sig_resume_state* st = sig_resume_current();
+
+  if (!st || !_should_retry(p, sig_type)) return SIG_RESTART_NULL;
+
+  if (p->max_attempts && st->attempt >= p->max_attempts) {
+    atomic_fetch_add_explicit(&p->exhausted, 1, memory_order_relaxed);
+    return SIG_RESTART_NULL;
+  }
+
+  uint64_t now = evsig_time_ns();
+  if (st->attempt == 1) st->start_ns = now;
+
+  uint64_t delay = _delay_ns(p, st->attempt);
+
+  if (p->deadline_ns && now + delay - st->start_ns > p->deadline_ns) {
+    atomic_fetch_add_explicit(&p->deadline_exceeded, 1, memory_order_relaxed);
+    return SIG_RESTART_NULL;
+  }
+
+  atomic_fetch_add_explicit(&p->retries, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&p->delay_ns_total, delay, memory_order_relaxed);
+
+  // The sleep is cut short by evsig_unwind_thread/evsig_cancel_thread, which
+  // we then handle here rather than after another attempt
+  if (delay) evsig_sleep_ns(delay);
+  SIG_CHECKPOINT();
+
+  return SIG_RESTART_RETRY;
+}
@@ -11,9 +11,12 @@
 #include <stdint.h>
 #include "libevsig/_signals.h"
 #include "libevsig/unwind.h"
+#include "libevsig/thread_signal.h"
 #include <string.h>
 #include <dlfcn.h>
 #include <assert.h>
+#include "libevsig/util.h"
+#include "libevsig/memory.h"
 
 #define CLR_RED     "\x1b[31m"
 #define CLR_GREEN   "\x1b[32m"
@@ -28,6 +31,9 @@ thread_local sig_handler_stack_entry* sig_handler_stack;
 thread_local int64_t sig_handler_stack_alloc;
 thread_local int64_t sig_handler_stack_fill;
 
+// Bumped on every handler push and removal
+thread_local uint64_t sig_handler_stack_generation = 1;
+
 thread_local sig_restart_stack_entry* sig_restart_stack;
 thread_local int64_t sig_restart_stack_alloc;
 thread_local int64_t sig_restart_stack_fill;
@@ -44,6 +50,11 @@ SIG_DEFTYPE(SIGNAL_WRITE_ERROR);
 SIG_DEFTYPE(SIGNAL_UNSUPPORTED);
 
 SIG_DEFTYPE(SIG_RESTART_NULL);
+SIG_DEFTYPE(SIG_RESTART_RETRY);
+SIG_DEFTYPE(SIG_RESTART_USE_VALUE);
+SIG_DEFTYPE(SIG_RESTART_CONTINUE);
+
+thread_local sig_resume_frame* sig_resume_top = NULL;
 
 #define MAX_FRAMES 64
 
@@ -169,6 +180,7 @@ void sig_init(bool threadlocal,
 
   sig_handler_stack_alloc = 32;
   sig_handler_stack_fill  = 0;
+  sig_handler_stack_generation++;
   sig_handler_stack       = malloc(sizeof(sig_handler_stack_entry)*sig_handler_stack_alloc);
   if (!sig_handler_stack) {
     fprintf(stderr, "Failed to allocate signal handler stack. Exiting.\n");
@@ -185,41 +197,344 @@ void sig_init(bool threadlocal,
 
   SIG_PERSISTENT_HANDLER(SIGNAL_ALL, catchall_handler, NULL);
   unwind_init(threadlocal);
+  _sig_thread_register();
+  _evsig_memory_init();
 }
 
 void sig_cleanup() {
+  _sig_thread_unregister();
   free(sig_handler_stack);
   free(sig_restart_stack);
+
+  // Sends after this find no handlers and return
+  sig_handler_stack       = NULL;
+  sig_handler_stack_fill  = 0;
+  sig_handler_stack_alloc = 0;
+  sig_restart_stack       = NULL;
+  sig_restart_stack_fill  = 0;
+  sig_restart_stack_alloc = 0;
+
   unwind_cleanup();
 }
 
-static void _run_restart(const char* sig_type, const char* restart_type) {
+// Set by sig_restart_args for the restart the handler is about to return.
+// One per dispatch, on its stack, so sends made by a handler can't clobber
+// args it already set.
+struct sig_args_frame {
+  unsigned char args[UNWIND_RETURN_POINT_ARGS_MAX];
+  size_t        size;
+};
+
+static thread_local sig_args_frame* sig_args_top = NULL;
+
+const char* sig_restart_args(const char* restart_type, const void* args, size_t size) {
+  if (size > UNWIND_RETURN_POINT_ARGS_MAX) {
+    fprintf(stderr, "Restart args for %s larger than UNWIND_RETURN_POINT_ARGS_MAX. Exiting.\n",
+            restart_type);
+    exit(1);
+  }
+
+  if (!sig_args_top) {
+    fprintf(stderr, "sig_restart_args for %s called outside a signal handler. Exiting.\n",
+            restart_type);
+    exit(1);
+  }
+
+  memcpy(sig_args_top->args, args, size);
+  sig_args_top->size = size;
+  return restart_type;
+}
+
+static void _run_restart(const char* sig_type, const char* restart_type,
+                         const sig_args_frame* a) {
   for (int64_t i = sig_restart_stack_fill-1; i >=0; i--) {
     sig_restart_stack_entry* e = sig_restart_stack+i;
     if (e->restart_type == restart_type
         && (e->sig_type == sig_type || e->sig_type == SIGNAL_ALL)) {
+      memcpy(e->p->args, a->args, a->size);
+      memset(e->p->args+a->size, 0, UNWIND_RETURN_POINT_ARGS_MAX-a->size);
+
+      // Frames of the sends being unwound out of are gone
+      sig_resume_top = e->resume_top;
+      sig_args_top   = e->args_top;
+
       UNWIND(e->p);
     }
   }
 }
 
-void _sig_send(const char* sig_type,
-               const char* msg,
-                     void* signal_data,
-                     sig_cleanup_func signal_data_cleanup_func) {
+static void _policy_flush_summary(sig_dispatch_policy* p) {
+  for (int64_t i = 0; i < SIG_DISPATCH_POLICY_SUMMARY_SLOTS; i++) {
+    if (!p->suppressed[i].count) continue;
+    if (p->summary)
+      p->summary(p->suppressed[i].sig_type, p->suppressed[i].count, p->summary_userdata);
+    p->suppressed[i].sig_type = NULL;
+    p->suppressed[i].count    = 0;
+  }
+}
+
+static void _policy_count_suppressed(sig_dispatch_policy* p, const char* sig_type) {
+  while (true) {
+    int64_t free_i = -1;
+    for (int64_t i = 0; i < SIG_DISPATCH_POLICY_SUMMARY_SLOTS; i++) {
+      if (p->suppressed[i].count && p->suppressed[i].sig_type == sig_type) {
+        p->suppressed[i].count++;
+        return;
+      }
+      if (!p->suppressed[i].count && free_i < 0) free_i = i;
+    }
+
+    if (free_i >= 0) {
+      p->suppressed[free_i].sig_type = sig_type;
+      p->suppressed[free_i].count    = 1;
+      return;
+    }
+
+    // Too many types to keep apart, report what we have
+    _policy_flush_summary(p);
+  }
+}
+
+// Returns true if the handler should be skipped for this send
+static bool _policy_suppress(sig_dispatch_policy* p, const char* sig_type, const void* site) {
+  uint64_t now = evsig_time_ns();
+
+  if (p->dedup_window_ns) {
+    int64_t slot = -1;
+    int64_t oldest = 0;
+    for (int64_t i = 0; i < SIG_DISPATCH_POLICY_DEDUP_SLOTS; i++) {
+      if (p->dedup[i].sig_type == sig_type && p->dedup[i].site == site) { slot = i; break; }
+      if (p->dedup[i].last_ns < p->dedup[oldest].last_ns) oldest = i;
+    }
+
+    if (slot >= 0 && now - p->dedup[slot].last_ns < p->dedup_window_ns) goto suppress;
+
+    if (slot < 0) {
+      slot = oldest;
+      p->dedup[slot].sig_type = sig_type;
+      p->dedup[slot].site     = site;
+    }
+    p->dedup[slot].last_ns = now;
+  }
+
+  if (p->rate_per_sec) {
+    uint64_t burst = p->burst ? p->burst : 1;
+    uint64_t cap   = (burst > UINT64_MAX/1000000000) ? UINT64_MAX : burst*1000000000;
+
+    if (!p->last_refill_ns) {
+      p->nanotokens = cap;
+    } else {
+      // Anything past cap/rate would fill the bucket anyway, and clamping
+      // there keeps elapsed*rate and the sum from overflowing
+      uint64_t elapsed = now - p->last_refill_ns;
+      uint64_t refill  = (elapsed > cap/p->rate_per_sec) ? cap : elapsed*p->rate_per_sec;
+      p->nanotokens = (p->nanotokens >= cap || refill > cap - p->nanotokens)
+        ? cap : p->nanotokens + refill;
+    }
+    p->last_refill_ns = now;
+
+    if (p->nanotokens < 1000000000) goto suppress;
+    p->nanotokens -= 1000000000;
+  }
+
+  return false;
+
+suppress:
+  _policy_count_suppressed(p, sig_type);
+  return true;
+}
+
+static bool _in_place_restart(sig_resume_frame* frame, const char* restart_type) {
+  return restart_type == SIG_RESTART_RETRY
+    || restart_type == SIG_RESTART_USE_VALUE
+    || restart_type == SIG_RESTART_CONTINUE
+    || (frame->state->extra_restart && restart_type == frame->state->extra_restart);
+}
+
+// (sig_type -> restart) decisions made by pure handlers, valid while
+// sig_handler_stack_generation is unchanged. Only the restart type is kept,
+// so decisions that carry a value (SIG_RESTART_USE_VALUE) or restart args
+// aren't cached.
+#define DECISION_CACHE_SIZE 16
+
+typedef struct {
+  const char* sig_type;
+  const char* restart_type;
+  uint64_t    generation;
+} decision_cache_entry;
+
+static thread_local decision_cache_entry decision_cache[DECISION_CACHE_SIZE];
+
+static decision_cache_entry* _decision_cache_slot(const char* sig_type) {
+  return decision_cache + (((uintptr_t)sig_type >> 3) & (DECISION_CACHE_SIZE-1));
+}
+
+// Exact matches win over SIGNAL_ALL clauses
+static const sig_clause* _match_clause(sig_handler_stack_entry* e, const char* sig_type) {
+  const sig_clause* all = NULL;
+  for (uint64_t i = 0; i < e->nclauses; i++) {
+    if (e->clauses[i].sig_type == sig_type) return e->clauses+i;
+    if (e->clauses[i].sig_type == SIGNAL_ALL && !all) all = e->clauses+i;
+  }
+  return all;
+}
+
+static bool _entry_has_handler(sig_handler_stack_entry* e, const char* sig_type) {
+  if (!e->clauses) return e->sig_type == sig_type;
+
+  for (uint64_t i = 0; i < e->nclauses; i++)
+    if (e->clauses[i].sig_type == sig_type) return true;
+  return false;
+}
+
+// Returns in-place restarts to the sender, unwinds for anything else
+static const char* _select_restart(sig_resume_frame* frame,
+                                   const sig_args_frame* a,
+                                   const char* sig_type,
+                                   const char* restart_type) {
+  if (frame && _in_place_restart(frame, restart_type)) return restart_type;
+
+  _run_restart(sig_type, restart_type, a);
+  fprintf(stderr, "Failed to run restart %s, exiting...\n", restart_type);
+  exit(1);
+}
+
+static const char* _dispatch_to_handlers(sig_resume_frame* frame,
+                                         sig_args_frame* a,
+                                         const void* site,
+                                         const char* sig_type,
+                                         const char* msg,
+                                         void* signal_data,
+                                         sig_cleanup_func signal_data_cleanup_func) {
+  decision_cache_entry* cached = _decision_cache_slot(sig_type);
+  if (cached->sig_type == sig_type && cached->generation == sig_handler_stack_generation) {
+    if (signal_data_cleanup_func) signal_data_cleanup_func(signal_data);
+    return _select_restart(frame, a, sig_type, cached->restart_type);
+  }
+
+  bool first_match = true;
 
   for (int64_t i = sig_handler_stack_fill-1; i >= 0; i--) {
     sig_handler_stack_entry* e = sig_handler_stack+i;
-    if (e->sig_type == sig_type || e->sig_type == SIGNAL_ALL) {
-      const char* restart_type = e->handler(sig_type, e->handler_userdata, msg, signal_data);
-      if (signal_data_cleanup_func) signal_data_cleanup_func(signal_data);
-      if (restart_type != SIG_RESTART_NULL) {
-        _run_restart(sig_type, restart_type);
-        fprintf(stderr, "Failed to run restart %s, exiting...\n", restart_type);
-        exit(1);
+
+    sig_handler handler  = e->handler;
+    void*       userdata = e->handler_userdata;
+    bool        pure     = e->pure;
+
+    if (e->clauses) {
+      const sig_clause* c = _match_clause(e, sig_type);
+      if (!c) continue;
+
+      handler  = c->handler;
+      userdata = c->userdata;
+      pure     = handler == (sig_handler)sig_static_handler;
+    } else if (e->sig_type != sig_type && e->sig_type != SIGNAL_ALL) {
+      continue;
+    }
+
+    const char* restart_type;
+
+    if (pure) {
+      restart_type = handler == (sig_handler)sig_static_handler
+        ? userdata
+        : handler(sig_type, userdata, msg, signal_data);
+
+      // Only the first matching handler's decision can be cached, as
+      // reaching a later one means calling the impure handlers above it
+      if (restart_type != SIG_RESTART_NULL && first_match
+          && restart_type != SIG_RESTART_USE_VALUE && !a->size) {
+        cached->sig_type     = sig_type;
+        cached->restart_type = restart_type;
+        cached->generation   = sig_handler_stack_generation;
       }
+    } else if (e->policy && _policy_suppress(e->policy, sig_type, site)) {
+      restart_type = e->policy->last_restart ? e->policy->last_restart : SIG_RESTART_NULL;
+    } else {
+      if (e->policy) _policy_flush_summary(e->policy);
+      restart_type = handler(sig_type, userdata, msg, signal_data);
+      if (e->policy) e->policy->last_restart = restart_type;
     }
+
+    if (signal_data_cleanup_func) signal_data_cleanup_func(signal_data);
+    if (restart_type != SIG_RESTART_NULL) return _select_restart(frame, a, sig_type, restart_type);
+    first_match = false;
+
+    // Args from a handler that declined aren't for the next one
+    a->size = 0;
   }
+
+  return SIG_RESTART_NULL;
+}
+
+// frame is NULL for non-resumable sends. Returns the in-place restart
+// selected, if any.
+static const char* _sig_dispatch(sig_resume_frame* frame,
+                                 const void* site,
+                                 const char* sig_type,
+                                 const char* msg,
+                                 void* signal_data,
+                                 sig_cleanup_func signal_data_cleanup_func) {
+
+  // Before sig_init or after sig_cleanup there's nothing to dispatch to
+  if (!sig_handler_stack_fill) return SIG_RESTART_NULL;
+
+  // Every send is a check point. This also picks up signals from other
+  // threads that interrupted a syscall, as those end up here via SIGNAL_EINTR.
+  SIG_CHECKPOINT();
+
+  // Handlers see only the innermost send's frames, so a handler sending its
+  // own signal doesn't expose the outer one's in-place restarts or args.
+  // Restored here on return, and by _run_restart (from the restart's entry)
+  // when a restart unwinds out of the send.
+  sig_args_frame    args      = { .size = 0 };
+  sig_resume_frame* prev_top  = sig_resume_top;
+  sig_args_frame*   prev_args = sig_args_top;
+  sig_resume_top = frame;
+  sig_args_top   = &args;
+
+  const char* r = _dispatch_to_handlers(frame, &args, site, sig_type, msg,
+                                        signal_data, signal_data_cleanup_func);
+
+  sig_resume_top = prev_top;
+  sig_args_top   = prev_args;
+  return r;
+}
+
+void _sig_send(const void* site,
+               const char* sig_type,
+               const char* msg,
+               void* signal_data,
+               sig_cleanup_func signal_data_cleanup_func) {
+  _sig_dispatch(NULL, site, sig_type, msg, signal_data, signal_data_cleanup_func);
+}
+
+const char* _sig_send_resumable(sig_resume_state* state,
+                                const void* site,
+                                const char* sig_type,
+                                const char* msg,
+                                void* signal_data,
+                                sig_cleanup_func signal_data_cleanup_func,
+                                intptr_t* value_out) {
+  sig_resume_state local = {0};
+  if (!state) state = &local;
+  state->attempt++;
+
+  sig_resume_frame frame = { .sig_type = sig_type, .value = 0, .state = state };
+
+  const char* r = _sig_dispatch(&frame, site,
+                                sig_type, msg, signal_data, signal_data_cleanup_func);
+
+  if (value_out) *value_out = frame.value;
+  return r;
+}
+
+const char* sig_use_value(intptr_t value) {
+  if (sig_resume_top) sig_resume_top->value = value;
+  return SIG_RESTART_USE_VALUE;
+}
+
+sig_resume_state* sig_resume_current() {
+  return sig_resume_top ? sig_resume_top->state : NULL;
 }
 
 uint64_t _sig_push_restart(const char* sig_type, const char* restart_type, unwind_return_point* p) {
@@ -238,7 +553,9 @@ uint64_t _sig_push_restart(const char* sig_type, const char* restart_type, unwin
     .sig_type = sig_type,
     .restart_type = restart_type,
     .p = p,
-    .id = 0
+    .id = 0,
+    .resume_top = sig_resume_top,
+    .args_top = sig_args_top
   };
 
   if (sig_restart_stack_fill > 0) e.id = sig_restart_stack[sig_restart_stack_fill-1].id+1;
@@ -267,6 +584,9 @@ void _sig_rm_restart(uint64_t id) {
 }
 
 bool _sig_restart_available(const char* sig_type, const char* restart_type) {
+  if (sig_resume_top && sig_resume_top->sig_type == sig_type
+      && _in_place_restart(sig_resume_top, restart_type)) return true;
+
   for (int64_t i = sig_restart_stack_fill-1; i >= 0; i--) {
     if (sig_restart_stack[i].sig_type == sig_type
         && sig_restart_stack[i].restart_type == restart_type) return true;
@@ -274,9 +594,7 @@ bool _sig_restart_available(const char* sig_type, const char* restart_type) {
   return false;
 }
 
-const uint64_t _sig_push_handler(const char* sig_type, sig_handler handler, void* userdata) {
-  if (!handler) return 0;
-
+static uint64_t _push_entry(sig_handler_stack_entry e) {
   if (sig_handler_stack_fill+1 > sig_handler_stack_alloc) {
     sig_handler_stack_alloc *= 2;
     sig_handler_stack =
@@ -288,18 +606,55 @@ const uint64_t _sig_push_handler(const char* sig_type, sig_handler handler, void
     }
   }
 
-  sig_handler_stack_entry e = { .sig_type = sig_type,
-                                .handler = handler,
-                                .handler_userdata = userdata,
-                                .id = 1 };
-
+  e.id = 1;
   if (sig_handler_stack_fill > 0) e.id = sig_handler_stack[sig_handler_stack_fill-1].id+1;
 
   sig_handler_stack[sig_handler_stack_fill++] = e;
+  sig_handler_stack_generation++;
 
   return e.id;
 }
 
+static uint64_t _push_handler(const char* sig_type,
+                              sig_handler handler,
+                              void* userdata,
+                              sig_dispatch_policy* policy,
+                              bool pure) {
+  if (!handler) return 0;
+
+  return _push_entry((sig_handler_stack_entry){
+    .sig_type = sig_type,
+    .handler = handler,
+    .handler_userdata = userdata,
+    .policy = policy,
+    .pure = !policy && (pure || handler == (sig_handler)sig_static_handler)
+  });
+}
+
+const uint64_t _sig_push_handler_table(const sig_clause* clauses, uint64_t nclauses) {
+  if (!nclauses) return 0;
+
+  return _push_entry((sig_handler_stack_entry){
+    .clauses = clauses,
+    .nclauses = nclauses
+  });
+}
+
+const uint64_t _sig_push_handler(const char* sig_type, sig_handler handler, void* userdata) {
+  return _push_handler(sig_type, handler, userdata, NULL, false);
+}
+
+const uint64_t _sig_push_handler_policy(const char* sig_type,
+                                        sig_handler handler,
+                                        void* userdata,
+                                        sig_dispatch_policy* policy) {
+  return _push_handler(sig_type, handler, userdata, policy, false);
+}
+
+const uint64_t _sig_push_pure_handler(const char* sig_type, sig_handler handler, void* userdata) {
+  return _push_handler(sig_type, handler, userdata, NULL, true);
+}
+
 void _sig_rm_handler(uint64_t id) {
   // Not a valid id, signals that we didn't actually push a handler (probably b/c it was NULL)
   if (id == 0) return;
@@ -316,21 +671,26 @@ void _sig_rm_handler(uint64_t id) {
 
   // Shift found handler out
   if (found >= 0) {
+    if (sig_handler_stack[found].policy) _policy_flush_summary(sig_handler_stack[found].policy);
+
     for (int64_t i = found; i < sig_handler_stack_fill-1; i++) {
       sig_handler_stack[i] = sig_handler_stack[i+1];
     }
 
     sig_handler_stack_fill--;
+    sig_handler_stack_generation++;
   }
 }
 
-void _sig_assert_handler(const char* sig_type) {
-  bool exists = false;
-  for (uint64_t i = 0; i < sig_handler_stack_fill; i++) {
-    if (sig_handler_stack[i].sig_type == sig_type) { exists = true; break; }
+bool sig_has_handler(const char* sig_type) {
+  for (int64_t i = 0; i < sig_handler_stack_fill; i++) {
+    if (_entry_has_handler(sig_handler_stack+i, sig_type)) return true;
   }
+  return false;
+}
 
-  if (!exists) {
+void _sig_assert_handler(const char* sig_type) {
+  if (!sig_has_handler(sig_type)) {
     char msg[1024];
     sprintf(msg, "Assertion failed: no signal handler for signal type %s\n", sig_type);
 
@@ -339,12 +699,7 @@ void _sig_assert_handler(const char* sig_type) {
 }
 
 void _sig_assertwarn_handler(const char* sig_type) {
-  bool exists = false;
-  for (uint64_t i = 0; i < sig_handler_stack_fill; i++) {
-    if (sig_handler_stack[i].sig_type == sig_type) { exists = true; break; }
-  }
-
-  if (!exists) {
+  if (!sig_has_handler(sig_type)) {
     fprintf(stderr,
             "WARNING: No signal handler for signal of asserted type %s\n",
             sig_type);
@@ -361,6 +716,14 @@ void _unwind_handler_sig_rm_restart(void* ptr) {
   _sig_rm_restart(id);
 }
 
+void _unwind_value_handler_sig_rm_handler(unwind_value id) {
+  _sig_rm_handler(UNWIND_VALUE_AS(id, uint64_t));
+}
+
+void _unwind_value_handler_sig_rm_restart(unwind_value id) {
+  _sig_rm_restart(UNWIND_VALUE_AS(id, uint64_t));
+}
+
 
 const char* sig_static_handler(const char* sig_type, void* userdata, char* msg, void* signal_data) {
   return userdata;
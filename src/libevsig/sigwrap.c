@@ -1,4 +1,7 @@
 #define _GNU_SOURCE
+// Sends from the wrappers are attributed to the wrapper's caller, see
+// _SIG_SITE
+#define _SIG_SITE() ((const void*)__builtin_return_address(0))
 #include "libevsig/sigwrap.h"
 #include "libevsig/errno_signals.h"
 #include <errno.h>
@@ -7,6 +10,10 @@
 #include "asm-generic/errno-base.h"
 #include "asm-generic/errno.h"
 #include "libevsig/signals.h"
+#include "libevsig/thread_signal.h"
+#include "libevsig/memory.h"
+#include <malloc.h>
+#include "libevsig/alloc_profile.h"
 #include "stdio.h"
 #include <sys/mman.h>
 #include <unistd.h>
@@ -18,30 +25,54 @@
 #include <sys/stat.h>
 
 void* sw_malloc(size_t size) {
-  void* out = malloc(size);
-
-  if (!out) SIG_SEND(SIGNAL_ALLOC_FAILED, "Memory allocation failed", NULL, NULL);
+  void* out;
+  if (!_EVSIG_BUDGET_CHARGE(size, (intptr_t*)&out)) return out;
+  EVSIG_ALLOC_RESUMABLE(out, malloc(size), size);
+  if (!out) _evsig_budget_refund(size);
+  _EVSIG_ALLOC_PROFILE(out, size);
 
   return out;
 }
 
 void* sw_realloc(void* ptr, size_t size) {
-  void* out = realloc(ptr, size);
+  void* out;
+  // Only an address once realloc has freed it. volatile, or GCC tracks it back
+  // to ptr and warns about a use after free.
+  volatile uintptr_t old_ptr = (uintptr_t)ptr;
+  size_t old = ptr ? malloc_usable_size(ptr) : 0;
+  if (size > old && !_EVSIG_BUDGET_CHARGE(size-old, (intptr_t*)&out)) return out;
+
+  EVSIG_ALLOC_RESUMABLE(out, realloc(ptr, size), size);
+  if (!out && size > old) _evsig_budget_refund(size-old);
 
-  if (!out) SIG_SEND(SIGNAL_ALLOC_FAILED, "Memory allocation failed", NULL, NULL);
+  // The profiler counts a realloc as a free and a new allocation. If it
+  // failed, ptr is still live.
+  if (out && old_ptr) _evsig_alloc_profile_free(old_ptr);
+  _EVSIG_ALLOC_PROFILE(out, size);
 
   return out;
 }
 
 void* sw_calloc(size_t nmemb, size_t size) {
-  void* out = calloc(nmemb, size);
-
-  if (!out) SIG_SEND(SIGNAL_ALLOC_FAILED, "Memory allocation failed", NULL, NULL);
+  void* out;
+  size_t total = (size && nmemb > SIZE_MAX/size) ? SIZE_MAX : nmemb*size;
+  if (!_EVSIG_BUDGET_CHARGE(total, (intptr_t*)&out)) return out;
+  EVSIG_ALLOC_RESUMABLE(out, calloc(nmemb, size), total);
+  if (!out) _evsig_budget_refund(total);
+  _EVSIG_ALLOC_PROFILE(out, total);
 
   return out;
 }
 
+void sw_free(void* ptr) {
+  if (!ptr) return;
+  _evsig_alloc_profile_free((uintptr_t)ptr);
+  free(ptr);
+}
+
 size_t sw_fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
+  SIG_CHECKPOINT();
+
   // TODO implement/use sw_feof? sw_ferror below?
   if (!stream) {
     SIG_SEND(SIGNAL_INVALID_INPUT, "fread: Can't read from NULL stream", NULL, NULL);
@@ -54,6 +85,16 @@ size_t sw_fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
 
   size_t out = fread(ptr, size, nmemb, stream);
 
+  // Interrupted (e.g. by evsig_signal_thread): handle what's pending and
+  // carry on where we left off. If some items already made it, return the
+  // short count instead so they aren't lost, and handle it on the next call.
+  while (out != nmemb && ferror(stream) && errno == EINTR) {
+    clearerr(stream);
+    if (out && atomic_load(&evsig_self.pending_sig)) return out;
+    SIG_CHECKPOINT();
+    out += fread((char*)ptr + out*size, size, nmemb-out, stream);
+  }
+
   // From fread docs:
   //
   // If an error occurs, or the end of the file is reached, the return value is
@@ -81,115 +122,158 @@ size_t sw_fread(void* ptr, size_t size, size_t nmemb, FILE* stream) {
   //  sent_signal = true;
   //}
 
+  if (!out) SIG_CHECKPOINT();
+
   return out;
 }
 
 size_t sw_fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream) {
+  SIG_CHECKPOINT();
+
   if (!stream) {
     SIG_SEND(SIGNAL_INVALID_INPUT, "fwrite: Can't write to NULL stream", NULL, NULL);
   }
 
   size_t out = fwrite(ptr, size, nmemb, stream);
 
+  while (out != nmemb && ferror(stream) && errno == EINTR) {
+    clearerr(stream);
+    if (out && atomic_load(&evsig_self.pending_sig)) return out;
+    SIG_CHECKPOINT();
+    out += fwrite((const char*)ptr + out*size, size, nmemb-out, stream);
+  }
+
   if (out != nmemb) {
     SIG_SEND(SIGNAL_WRITE_ERROR, "fwrite error", NULL, NULL);
   }
 
+  if (!out) SIG_CHECKPOINT();
+
   return out;
 }
 
 ssize_t sw_pwrite(int fd, const void* buf, size_t nbyte, off_t offset) {
-  ssize_t out = pwrite(fd, buf, nbyte, offset);
+  SIG_CHECKPOINT();
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("pwrite(): ", errno),
-             NULL, NULL);
+  ssize_t out;
+  SIG_RESUMABLE_EINTR(out, pwrite(fd, buf, nbyte, offset), out == -1,
+                      sig_from_errno(errno), str_from_errno("pwrite(): ", errno));
+
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
 
 // TODO grep for all fopen usage and replace
 FILE* sw_fopen(const char* pathname, const char* mode) {
-  FILE* out = fopen(pathname, mode);
+  SIG_CHECKPOINT();
 
   // fopen: If NULL is returned, we have an error. Will then set errno.
 
-  if (!out) SIG_SEND(sig_from_errno(errno), str_from_errno("fopen(): ", errno),
-                     NULL, NULL);
+  FILE* out;
+  SIG_RESUMABLE_EINTR(out, fopen(pathname, mode), !out,
+                      sig_from_errno(errno), str_from_errno("fopen(): ", errno));
+
+  if (!out) SIG_CHECKPOINT();
 
   return out;
 }
 
 int sw_fclose(FILE* stream) {
+  SIG_CHECKPOINT();
+
+  // fclose() frees stream even when it fails, so it's called exactly once
+  // and its failure is sent without SIG_RESTART_RETRY. Only the flush before
+  // it is retried, on EINTR. Checkpointing waits until stream is closed, so
+  // an unwind can't leak it.
+  bool interrupted = false;
+  int  flushed;
+  while ((flushed = fflush(stream)) != 0 && errno == EINTR) interrupted = true;
+  int flush_errno = errno;
+
   int out = fclose(stream);
+  if (flushed != 0) {
+    out = EOF;
+    SIG_SEND(sig_from_errno(flush_errno), str_from_errno("fclose(): fflush(): ", flush_errno),
+             NULL, NULL);
+  } else if (out != 0) {
+    int close_errno = errno;
+    SIG_SEND(sig_from_errno(close_errno), str_from_errno("fclose(): ", close_errno), NULL, NULL);
+  }
 
-  if (out) SIG_SEND(sig_from_errno(errno), str_from_errno("fclose(): ", errno),
-                    NULL, NULL);
+  if (out != 0 || interrupted) SIG_CHECKPOINT();
 
   return out;
 }
 
 int sw_fflush(FILE* stream) {
-  int out = fflush(stream);
+  SIG_CHECKPOINT();
+
+  int out;
+  SIG_RESUMABLE_EINTR(out, fflush(stream), out != 0,
+                      sig_from_errno(errno), str_from_errno("fflush(): ", errno));
 
-  if (out) SIG_SEND(sig_from_errno(errno), str_from_errno("fflush(): ", errno),
-                    NULL, NULL);
+  if (out != 0) SIG_CHECKPOINT();
 
   return out;
 }
 
 int sw_munmap(void* addr, size_t len) {
-  int out = munmap(addr, len);
-
-  if (out) SIG_SEND(sig_from_errno(errno), str_from_errno("munmap(): ", errno),
-                    NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, munmap(addr, len), out != 0,
+                sig_from_errno(errno), str_from_errno("munmap(): ", errno));
 
   return out;
 }
 
 void* sw_mmap(void* addr, size_t len, int prot, int flags, int fd, off_t off) {
-  void* out = mmap(addr, len, prot, flags, fd, off);
-
-  if (out == MAP_FAILED) {
-    SIG_SEND(sig_from_errno(errno), str_from_errno("mmap(): ", errno), NULL, NULL)
-  }
+  void* out;
+  SIG_RESUMABLE(out, mmap(addr, len, prot, flags, fd, off), out == MAP_FAILED,
+                sig_from_errno(errno), str_from_errno("mmap(): ", errno));
 
   return out;
 }
 
 int sw_madvise(void* addr, size_t size, int advice) {
-  int out = madvise(addr, size, advice);
-
-  if (out == -1) SIG_SEND(sig_from_errno(errno),
-                          str_from_errno("madvise(): ", errno),
-                          NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, madvise(addr, size, advice), out == -1,
+                sig_from_errno(errno), str_from_errno("madvise(): ", errno));
 
   return out;
 }
 
 int sw_msync(void* addr, size_t len, int flags) {
-  int out = msync(addr, len, flags);
+  SIG_CHECKPOINT();
 
-  if (out) SIG_SEND(sig_from_errno(errno), str_from_errno("msync(): ", errno),
-                    NULL, NULL);
+  int out;
+  SIG_RESUMABLE_EINTR(out, msync(addr, len, flags), out != 0,
+                      sig_from_errno(errno), str_from_errno("msync(): ", errno));
+
+  if (out != 0) SIG_CHECKPOINT();
 
   return out;
 }
 
 int sw_fsync(int fd) {
-  int out = fsync(fd);
+  SIG_CHECKPOINT();
+
+  int out;
+  SIG_RESUMABLE_EINTR(out, fsync(fd), out != 0,
+                      sig_from_errno(errno), str_from_errno("fsync(): ", errno));
 
-  if (out) SIG_SEND(sig_from_errno(errno), str_from_errno("fsync(): ", errno),
-                    NULL, NULL);
+  if (out != 0) SIG_CHECKPOINT();
 
   return out;
 }
 
 int sw_fdatasync(int fd) {
-  int out = fdatasync(fd);
+  SIG_CHECKPOINT();
+
+  int out;
+  SIG_RESUMABLE_EINTR(out, fdatasync(fd), out != 0,
+                      sig_from_errno(errno), str_from_errno("fdatasync(): ", errno));
 
-  if (out) SIG_SEND(sig_from_errno(errno), str_from_errno("fdatasync(): ", errno),
-                    NULL, NULL);
+  if (out != 0) SIG_CHECKPOINT();
 
   return out;
 }
@@ -199,42 +283,37 @@ int sw_fseek(FILE* stream, long offset, int whence) {
     SIG_SEND(SIGNAL_INVALID_INPUT, "fseek: Can't seek NULL stream", NULL, NULL);
   }
 
-  int out = fseek(stream, offset, whence);
-
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("fseek(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, fseek(stream, offset, whence), out == -1,
+                sig_from_errno(errno), str_from_errno("fseek(): ", errno));
 
   return out;
 }
 
 int sw_ftruncate(int fd, off_t len) {
-  int out = ftruncate(fd, len);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("ftruncate(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE_EINTR(out, ftruncate(fd, len), out == -1,
+                      sig_from_errno(errno), str_from_errno("ftruncate(): ", errno));
 
   return out;
 }
 
 int sw_fallocate(int fd, int mode, off_t off, off_t size) {
-  int out = fallocate(fd, mode, off, size);
+  SIG_CHECKPOINT();
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("fallocate(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE_EINTR(out, fallocate(fd, mode, off, size), out == -1,
+                      sig_from_errno(errno), str_from_errno("fallocate(): ", errno));
+
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
 
 int sw_fstat(int fd, struct stat* buf) {
-  int out = fstat(fd, buf);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("fstat(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, fstat(fd, buf), out == -1,
+                sig_from_errno(errno), str_from_errno("fstat(): ", errno));
 
   return out;
 }
@@ -270,63 +349,63 @@ int sw_fprintf(FILE* stream, const char* format, ...) {
 }
 
 int sw_fcntl3(int fd, int cmd, uint64_t a) {
-  int out = fcntl(fd, cmd, a);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("fcntl(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE_EINTR(out, fcntl(fd, cmd, a), out == -1,
+                      sig_from_errno(errno), str_from_errno("fcntl(): ", errno));
 
   return out;
 }
 
 int sw_fcntl2(int fd, int cmd) {
-  int out = fcntl(fd, cmd);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("fcntl(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE_EINTR(out, fcntl(fd, cmd), out == -1,
+                      sig_from_errno(errno), str_from_errno("fcntl(): ", errno));
 
   return out;
 }
 
 const char* sw_inet_ntop(int af, const void *restrict src,
                          char dst[], socklen_t size) {
-  const char* out = inet_ntop(af, src, dst, size);
-
-  if (!out)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("net_ntop(): ", errno),
-             NULL, NULL);
+  const char* out;
+  SIG_RESUMABLE(out, inet_ntop(af, src, dst, size), !out,
+                sig_from_errno(errno), str_from_errno("net_ntop(): ", errno));
 
   return out;
 }
 
 ssize_t sw_read(int fd, void* buf, size_t nbyte) {
-  ssize_t out = read(fd, buf, nbyte);
+  SIG_CHECKPOINT();
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("read(): ", errno),
-             NULL, NULL);
+  ssize_t out;
+  SIG_RESUMABLE_EINTR(out, read(fd, buf, nbyte), out == -1,
+                      sig_from_errno(errno), str_from_errno("read(): ", errno));
+
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
 
 
 ssize_t sw_write(int fd, const void* buf, size_t nbyte) {
-  ssize_t out = write(fd, buf, nbyte);
+  SIG_CHECKPOINT();
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("write(): ", errno),
-             NULL, NULL);
+  ssize_t out;
+  SIG_RESUMABLE_EINTR(out, write(fd, buf, nbyte), out == -1,
+                      sig_from_errno(errno), str_from_errno("write(): ", errno));
+
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
 
 ssize_t sw_getrandom(void* buf, size_t size, unsigned int flags) {
-  ssize_t out = getrandom(buf, size, flags);
+  SIG_CHECKPOINT();
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("getrandom(): ", errno),
-             NULL, NULL);
+  ssize_t out;
+  SIG_RESUMABLE_EINTR(out, getrandom(buf, size, flags), out == -1,
+                      sig_from_errno(errno), str_from_errno("getrandom(): ", errno));
+
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
@@ -1,35 +1,37 @@
+// Sends from the wrappers are attributed to the wrapper's caller, see
+// _SIG_SITE
+#define _SIG_SITE() ((const void*)__builtin_return_address(0))
 #include "libevsig/sigwrap_epoll.h"
 #include "libevsig/signals.h"
+#include "libevsig/thread_signal.h"
 #include "libevsig/errno_signals.h"
 #include <sys/epoll.h>
 #include <errno.h>
 
 int sw_epoll_create1(int flags) {
-  int out = epoll_create1(flags);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("epoll_create1(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, epoll_create1(flags), out == -1,
+                sig_from_errno(errno), str_from_errno("epoll_create1(): ", errno));
 
   return out;
 }
 
 int sw_epoll_ctl(int epfd, int op, int fd, struct epoll_event *_Nullable event) {
-  int out = epoll_ctl(epfd, op, fd, event);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("epoll_ctl(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, epoll_ctl(epfd, op, fd, event), out == -1,
+                sig_from_errno(errno), str_from_errno("epoll_ctl(): ", errno));
 
   return out;
 }
 
 int sw_epoll_wait(int epfd, struct epoll_event *_Nonnull events, int n, int timeout) {
-  int out = epoll_wait(epfd, events, n, timeout);
+  SIG_CHECKPOINT();
+
+  int out;
+  SIG_RESUMABLE_EINTR(out, epoll_wait(epfd, events, n, timeout), out == -1,
+                      sig_from_errno(errno), str_from_errno("epoll_wait(): ", errno));
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("epoll_wait(): ", errno),
-             NULL, NULL);
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
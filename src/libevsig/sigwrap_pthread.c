@@ -1,5 +1,9 @@
+// Sends from the wrappers are attributed to the wrapper's caller, see
+// _SIG_SITE
+#define _SIG_SITE() ((const void*)__builtin_return_address(0))
 #include "libevsig/sigwrap_pthread.h"
 #include "libevsig/signals.h"
+#include "libevsig/thread_signal.h"
 #include "libevsig/errno_signals.h"
 #include <errno.h>
 
@@ -7,25 +11,25 @@ int sw_pthread_create(pthread_t *restrict thread,
                       const pthread_attr_t *restrict attr,
                       typeof(void *(void *)) *start_routine,
                       void *restrict arg) {
-  int out = pthread_create(thread, attr, start_routine, arg);
-  if (out)
-    SIG_SEND(sig_from_errno(out), str_from_errno("pthread_create(): ", out),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, pthread_create(thread, attr, start_routine, arg), out != 0,
+                sig_from_errno(out), str_from_errno("pthread_create(): ", out));
   return out;
 }
 
 int sw_pthread_join(pthread_t thread, void** retval) {
-  int out = pthread_join(thread, retval);
-  if (out)
-    SIG_SEND(sig_from_errno(out), str_from_errno("pthread_join(): ", out),
-             NULL, NULL);
+  SIG_CHECKPOINT();
+
+  int out;
+  SIG_RESUMABLE(out, pthread_join(thread, retval), out != 0,
+                sig_from_errno(out), str_from_errno("pthread_join(): ", out));
+  if (out != 0) SIG_CHECKPOINT();
   return out;
 }
 
 int sw_pthread_cancel(pthread_t thread) {
-  int out = pthread_cancel(thread);
-  if (out)
-    SIG_SEND(sig_from_errno(out), str_from_errno("pthread_cancel(): ", out),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, pthread_cancel(thread), out != 0,
+                sig_from_errno(out), str_from_errno("pthread_cancel(): ", out));
   return out;
 }
@@ -1,14 +1,17 @@
+// Sends from the wrappers are attributed to the wrapper's caller, see
+// _SIG_SITE
+#define _SIG_SITE() ((const void*)__builtin_return_address(0))
 #include "libevsig/signals.h"
+#include "libevsig/thread_signal.h"
 #include "libevsig/errno_signals.h"
 #include <sys/socket.h>
+#include <poll.h>
 #include <errno.h>
 
 int sw_socket(int domain, int type, int protocol) {
-  int out = socket(domain, type, protocol);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("socket(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, socket(domain, type, protocol), out == -1,
+                sig_from_errno(errno), str_from_errno("socket(): ", errno));
 
   return out;
 }
@@ -18,42 +21,64 @@ int sw_setsockopt(int socket,
                   int option_name,
                   const void* option_value,
                   socklen_t option_len) {
-  int out = setsockopt(socket, level, option_name, option_value, option_len);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("setsockopt(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, setsockopt(socket, level, option_name, option_value, option_len), out == -1,
+                sig_from_errno(errno), str_from_errno("setsockopt(): ", errno));
 
   return out;
 }
 
 int sw_bind(int socket, const struct sockaddr* address, socklen_t address_len) {
-  int out = bind(socket, address, address_len);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("bind(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, bind(socket, address, address_len), out == -1,
+                sig_from_errno(errno), str_from_errno("bind(): ", errno));
 
   return out;
 }
 
 int sw_listen(int socket, int backlog) {
-  int out = listen(socket, backlog);
-
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("listen(): ", errno),
-             NULL, NULL);
+  int out;
+  SIG_RESUMABLE(out, listen(socket, backlog), out == -1,
+                sig_from_errno(errno), str_from_errno("listen(): ", errno));
 
   return out;
 }
 
 
+// connect() that handles EINTR. An interrupted connect carries on in the
+// background, and calling connect() again fails with EALREADY, so wait for it
+// to finish instead.
+static int _connect(int socket, const struct sockaddr* address, socklen_t address_len) {
+  if (connect(socket, address, address_len) == 0) return 0;
+  if (errno != EINTR) return -1;
+
+  while (true) {
+    SIG_CHECKPOINT();
+
+    struct pollfd p = { .fd = socket, .events = POLLOUT };
+    int r = poll(&p, 1, -1);
+    if (r == -1 && errno == EINTR) continue;
+    if (r == -1) return -1;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return -1;
+    if (err) {
+      errno = err;
+      return -1;
+    }
+    return 0;
+  }
+}
+
 int sw_connect(int socket, const struct sockaddr* address, socklen_t address_len) {
-  int out = connect(socket, address, address_len);
+  SIG_CHECKPOINT();
+
+  int out;
+  SIG_RESUMABLE(out, _connect(socket, address, address_len), out == -1,
+                sig_from_errno(errno), str_from_errno("connect(): ", errno));
 
-  if (out == -1)
-    SIG_SEND(sig_from_errno(errno), str_from_errno("connect(): ", errno),
-             NULL, NULL);
+  if (out == -1) SIG_CHECKPOINT();
 
   return out;
 }
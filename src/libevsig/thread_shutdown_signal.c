@@ -1,11 +1,19 @@
+#define _GNU_SOURCE // Needed for gettid() and tgkill()
 #include "libevsig/thread_shutdown_signal.h"
 #include "libevsig/evsig_mutex.h"
+#include "libevsig/unwind.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include "libevsig/util.h"
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <threads.h>
+#include <fcntl.h>
+#include <string.h>
+#include <inttypes.h>
 
 // TODO set up shutdown thread
 
@@ -13,6 +21,23 @@ evsig_thread_shutdown_signal evsig_global_thread_shutdown_signal =
 EVSIG_THREAD_SHUTDOWN_SIGNAL_INIT;
 
 
+// Signals the current thread registered itself with, so we can confirm
+// shutdown on its behalf if it exits without doing so.
+static pthread_key_t  exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+// After fork() only the forking thread exists in the child, so the registry
+// has to be brought back to a consistent state there.
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+static pid_t          fork_parent_tid;
+
+// Set in a forked child until its shutdown threads have been restarted
+static _Atomic bool restart_after_fork = false;
+
+static thread_local evsig_thread_shutdown_signal** self_registered       = NULL;
+static thread_local uint64_t                       self_registered_fill  = 0;
+static thread_local uint64_t                       self_registered_alloc = 0;
+
 // For signal-handler-safe printing
 static void _print(char* msg) {
   uint64_t len = 0;
@@ -25,6 +50,190 @@ static void _print(char* msg) {
   (void)write(STDERR_FILENO, msg, len);
 }
 
+// pthread key destructor, runs when a thread that registered itself exits
+static void _confirm_on_thread_exit(void* ud) {
+  pid_t tid = gettid();
+
+  // confirm_shutdown removes the signal from self_registered
+  while (self_registered_fill > 0)
+    evsig_thread_shutdown_signal_confirm_shutdown(
+      self_registered[self_registered_fill-1], tid);
+
+  free(self_registered);
+  self_registered       = NULL;
+  self_registered_alloc = 0;
+}
+
+static void _create_exit_key() {
+  if (pthread_key_create(&exit_key, _confirm_on_thread_exit) != 0) {
+    fprintf(stderr, "Failed to create thread exit key for libevsig "
+                    "shutdown signal");
+    exit(1);
+  }
+}
+
+static void _track_self_registration(evsig_thread_shutdown_signal* s) {
+  pthread_once(&exit_key_once, _create_exit_key);
+
+  for (uint64_t i = 0; i < self_registered_fill; i++)
+    if (self_registered[i] == s) return;
+
+  if (self_registered_fill >= self_registered_alloc) {
+    if (!self_registered_alloc) self_registered_alloc  = 4;
+    else                        self_registered_alloc *= 2;
+
+    self_registered = realloc(self_registered,
+                              sizeof(evsig_thread_shutdown_signal*)*self_registered_alloc);
+    if (!self_registered) {
+      fprintf(stderr, "Failed to (re)allocate registration list for libevsig "
+                      "shutdown signal");
+      exit(1);
+    }
+  }
+
+  self_registered[self_registered_fill++] = s;
+
+  // Destructors only run for non-NULL values
+  pthread_setspecific(exit_key, self_registered);
+}
+
+static void _untrack_self_registration(evsig_thread_shutdown_signal* s) {
+  for (uint64_t i = 0; i < self_registered_fill; i++) {
+    if (self_registered[i] == s) {
+      self_registered[i] = self_registered[--self_registered_fill];
+      return;
+    }
+  }
+}
+
+// Marks t as done in the timings of a send in progress. Call with
+// master_mutex held.
+static void _record_confirm(evsig_thread_shutdown_signal* s, pid_t t, bool exited) {
+  for (uint64_t i = 0; i < s->timings_fill; i++) {
+    evsig_thread_shutdown_timing* e = s->timings+i;
+    if (e->tid == t && !e->confirmed_us) {
+      e->confirmed_us = evsig_time_us();
+      e->exited       = exited;
+    }
+  }
+}
+
+static void _read_thread_name(pid_t t, char name[16]) {
+  name[0] = '\0';
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", t);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return;
+
+  ssize_t n = read(fd, name, 15);
+  close(fd);
+  if (n <= 0) return;
+
+  name[n] = '\0';
+  if (name[n-1] == '\n') name[n-1] = '\0';
+}
+
+static void* _shutdown_thread(void* ud);
+
+// Locks s and its whole group tree, parents before children
+static void _lock_tree(evsig_thread_shutdown_signal* s) {
+  evsig_lock(&s->master_mutex);
+  for (uint64_t i = 0; i < s->children_fill; i++) _lock_tree(s->children[i]);
+}
+
+static void _unlock_tree(evsig_thread_shutdown_signal* s) {
+  for (uint64_t i = 0; i < s->children_fill; i++) _unlock_tree(s->children[i]);
+  evsig_unlock(&s->master_mutex);
+}
+
+// Resets s and its group tree in a forked child. Everything is locked by
+// _atfork_prepare, so the state we see is consistent.
+static void _reset_tree_after_fork(evsig_thread_shutdown_signal* s) {
+  for (uint64_t i = 0; i < s->children_fill; i++) _reset_tree_after_fork(s->children[i]);
+
+  // Only the forking thread survived. Keep it registered under its new tid.
+  bool had_self = false;
+  for (uint64_t i = 0; i < s->threadlist_fill; i++)
+    if (s->threadlist[i] == fork_parent_tid) { had_self = true; break; }
+
+  s->threadlist_fill = 0;
+  if (had_self) s->threadlist[s->threadlist_fill++] = gettid();
+
+  free(s->timings);
+  s->timings      = NULL;
+  s->timings_fill = 0;
+
+  // Shared with the parent, writing to it would wake the parent's watchers
+  if (s->eventfd != -1) close(s->eventfd);
+  s->eventfd = -1;
+
+  // The shutdown thread wasn't forked. Creating threads here isn't safe if
+  // the parent was multithreaded, so it's restarted by _restart_after_fork.
+  s->shutdown_thread_started = false;
+  evsig_ensure_locked(&s->shutdown_mutex);
+
+  evsig_unlock(&s->master_mutex);
+}
+
+static void _start_shutdown_threads(evsig_thread_shutdown_signal* s) {
+  evsig_lock(&s->master_mutex);
+  if (s->threadlist_fill && !s->shutdown_thread_started) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, _shutdown_thread, s) == 0) {
+      pthread_detach(t);
+      s->shutdown_thread_started = true;
+    }
+  }
+
+  for (uint64_t i = 0; i < s->children_fill; i++) _start_shutdown_threads(s->children[i]);
+  evsig_unlock(&s->master_mutex);
+}
+
+void _evsig_thread_shutdown_restart_after_fork() {
+  if (__builtin_expect(atomic_load_explicit(&restart_after_fork, memory_order_relaxed), 0)
+      && atomic_exchange(&restart_after_fork, false))
+    _start_shutdown_threads(&evsig_global_thread_shutdown_signal);
+}
+
+static void _atfork_prepare() {
+  fork_parent_tid = gettid();
+  _lock_tree(&evsig_global_thread_shutdown_signal);
+}
+
+static void _atfork_parent() {
+  _unlock_tree(&evsig_global_thread_shutdown_signal);
+}
+
+static void _atfork_child() {
+  _reset_tree_after_fork(&evsig_global_thread_shutdown_signal);
+  atomic_store(&restart_after_fork, true);
+}
+
+static void _atfork_init() {
+  pthread_atfork(_atfork_prepare, _atfork_parent, _atfork_child);
+}
+
+// Removes threads that no longer exist from the threadlist. Call with
+// master_mutex held.
+//
+// Catches threads that exited without confirming where the exit key couldn't,
+// such as threads created with raw clone() or killed from the outside.
+static void _prune_dead_threads(evsig_thread_shutdown_signal* s) {
+  pid_t pid = getpid();
+
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < s->threadlist_fill; i++) {
+    if (tgkill(pid, s->threadlist[i], 0) == -1 && errno == ESRCH) {
+      _record_confirm(s, s->threadlist[i], true);
+      continue;
+    }
+    s->threadlist[kept++] = s->threadlist[i];
+  }
+  s->threadlist_fill = kept;
+}
+
 static void* _shutdown_thread(void* ud) {
   evsig_thread_shutdown_signal* s = ud;
 
@@ -41,15 +250,27 @@ static void* _shutdown_thread(void* ud) {
 
   evsig_await_unlock(&s->shutdown_mutex);
 
+  evsig_lock(&s->master_mutex);
+  uint64_t timeout_ms = s->timeout_ms;
+  evsig_unlock(&s->master_mutex);
+
+  char msg[128];
+  snprintf(msg, sizeof(msg),
+           "[libevsig] Waiting up to %" PRIu64 " ms for threads to exit...\n", timeout_ms);
+
   _print("[libevsig] Asking all threads listening for evsig shutdown signal to exit.\n");
-  _print("[libevsig] Waiting up to 5 seconds for threads to exit...\n");
+  _print(msg);
 
-  if (evsig_thread_shutdown_signal_send_block(&evsig_global_thread_shutdown_signal,
-        5000)) {
+  evsig_thread_shutdown_report report = {0};
+  if (evsig_thread_shutdown_signal_send_block_report(s, timeout_ms, &report)) {
     _print("[libevsig] Timed out, some threads didn't exit. Exiting uncleanly.\n");
     _print("[libevsig] To avoid this, make sure your threads exit when "
         "requested via the evsig_shutdown_signal system.\n");
+
+    evsig_thread_shutdown_report_sort(&report);
+    evsig_thread_shutdown_report_print(&report, STDERR_FILENO, 0);
   }
+  evsig_thread_shutdown_report_free(&report);
 
   // There might be other threads not using our system. Thus we should
   // explicitly exit to make sure everything stops (if the user has configured
@@ -69,6 +290,9 @@ static void* _shutdown_thread(void* ud) {
 
 void evsig_thread_shutdown_signal_register_thread(evsig_thread_shutdown_signal* s,
                                                   pid_t t) {
+  _evsig_thread_shutdown_restart_after_fork();
+  pthread_once(&atfork_once, _atfork_init);
+
   evsig_lock(&s->master_mutex);
   do {
 
@@ -94,6 +318,8 @@ void evsig_thread_shutdown_signal_register_thread(evsig_thread_shutdown_signal*
     // Insert thread
     s->threadlist[s->threadlist_fill++] = t;
 
+    if (t == gettid()) _track_self_registration(s);
+
     // Start the shutdown thread if it's not running already
     if (!s->shutdown_thread_started) {
       evsig_ensure_locked(&s->shutdown_mutex);
@@ -118,8 +344,12 @@ void evsig_thread_shutdown_signal_confirm_shutdown(
     evsig_thread_shutdown_signal* s,
     pid_t t) {
 
+  if (t == gettid()) _untrack_self_registration(s);
+
   evsig_lock(&s->master_mutex);
   {
+    _record_confirm(s, t, false);
+
     // Shift all instances of this thread out of the list
     uint64_t shift = 0;
     for (uint64_t i = 0; i < s->threadlist_fill; i++) {
@@ -146,6 +376,7 @@ uint64_t evsig_thread_shutdown_signal_register_cb(
     evsig_thread_shutdown_signal* s,
     void (*cb)(void*),
     void* ud) {
+  _evsig_thread_shutdown_restart_after_fork();
 
   uint64_t ret = 0;
 
@@ -215,18 +446,78 @@ void unwind_handler_evsig_thread_shutdown_signal_unregister_cb(void* ptr) {
 
 bool evsig_thread_shutdown_signal_send_block(evsig_thread_shutdown_signal* s,
                                              uint64_t timeout_ms) {
+  return evsig_thread_shutdown_signal_send_block_report(s, timeout_ms, NULL);
+}
+
+bool evsig_thread_shutdown_signal_send_block_report(evsig_thread_shutdown_signal* s,
+                                                    uint64_t timeout_ms,
+                                                    evsig_thread_shutdown_report* report) {
+  _evsig_thread_shutdown_restart_after_fork();
   bool ret = false;
 
   do {
     if (atomic_load(&s->shutdown)) break;
 
+    // Drain our children first, in phase order. They're sorted on insert.
+    for (uint64_t i = 0;; i++) {
+      evsig_thread_shutdown_signal* child = NULL;
+      uint64_t child_timeout_ms = 0;
+
+      evsig_lock(&s->master_mutex);
+      if (i < s->children_fill) child = s->children[i];
+      evsig_unlock(&s->master_mutex);
+
+      if (!child) break;
+
+      evsig_lock(&child->master_mutex);
+      child_timeout_ms = child->timeout_ms;
+      evsig_unlock(&child->master_mutex);
+
+      if (evsig_thread_shutdown_signal_send_block_report(child, child_timeout_ms, report))
+        ret = true;
+    }
+
     // Set the shutdown flag and call all callbacks to notify threads to stop
     atomic_store(&s->shutdown, 1);
+    uint64_t timings_fill = 0;
     evsig_lock(&s->master_mutex);
+    if (report && s->threadlist_fill) {
+      s->timings = calloc(s->threadlist_fill, sizeof(evsig_thread_shutdown_timing));
+      if (!s->timings) {
+        fprintf(stderr, "Failed to allocate timings for libevsig shutdown signal");
+        exit(1);
+      }
+
+      uint64_t now = evsig_time_us();
+      for (uint64_t i = 0; i < s->threadlist_fill; i++) {
+        evsig_thread_shutdown_timing* e = s->timings+i;
+        e->tid         = s->threadlist[i];
+        e->group       = s;
+        e->notified_us = now;
+      }
+      s->timings_fill = s->threadlist_fill;
+      timings_fill    = s->timings_fill;
+    }
+    if (s->eventfd != -1) (void)eventfd_write(s->eventfd, 1);
     for (uint64_t i = 0; i < s->callbacks_fill; i++)
       s->callbacks[i].cb(s->callbacks[i].ud);
     evsig_unlock(&s->master_mutex);
 
+    // Names come from /proc, so read them without holding the lock. Only we
+    // resize or hand over timings, so the entries stay put.
+    for (uint64_t i = 0; i < timings_fill; i++) {
+      evsig_lock(&s->master_mutex);
+      pid_t tid = s->timings[i].tid;
+      evsig_unlock(&s->master_mutex);
+
+      char name[16];
+      _read_thread_name(tid, name);
+
+      evsig_lock(&s->master_mutex);
+      memcpy(s->timings[i].name, name, sizeof(name));
+      evsig_unlock(&s->master_mutex);
+    }
+
     // Block until threadlist is empty or timeout is elapsed
     bool have_threads = true;
     uint64_t slep = 64;
@@ -234,6 +525,7 @@ bool evsig_thread_shutdown_signal_send_block(evsig_thread_shutdown_signal* s,
     uint64_t start_ms = evsig_time_ms();
     while(have_threads) {
       evsig_lock(&s->master_mutex);
+      _prune_dead_threads(s);
       if (!s->threadlist_fill) have_threads = false;
       evsig_unlock(&s->master_mutex);
 
@@ -250,6 +542,28 @@ bool evsig_thread_shutdown_signal_send_block(evsig_thread_shutdown_signal* s,
       }
     }
 
+    // Hand timings over to the report
+    evsig_lock(&s->master_mutex);
+    if (s->timings_fill) {
+      if (report->fill + s->timings_fill > report->alloc) {
+        report->alloc = report->fill + s->timings_fill;
+        report->entries = realloc(report->entries,
+                                  sizeof(evsig_thread_shutdown_timing)*report->alloc);
+        if (!report->entries) {
+          fprintf(stderr, "Failed to (re)allocate libevsig shutdown report");
+          exit(1);
+        }
+      }
+
+      memcpy(report->entries+report->fill, s->timings,
+             sizeof(evsig_thread_shutdown_timing)*s->timings_fill);
+      report->fill += s->timings_fill;
+    }
+    free(s->timings);
+    s->timings      = NULL;
+    s->timings_fill = 0;
+    evsig_unlock(&s->master_mutex);
+
     // Free resources associated with this signal
 
     free(s->callbacks);
@@ -266,13 +580,198 @@ bool evsig_thread_shutdown_signal_send_block(evsig_thread_shutdown_signal* s,
 }
 
 bool evsig_thread_shutdown_p(evsig_thread_shutdown_signal* s) {
-  return atomic_load(&evsig_global_thread_shutdown_signal.shutdown);
+  return atomic_load(&s->shutdown);
+}
+
+int evsig_thread_shutdown_signal_eventfd(evsig_thread_shutdown_signal* s) {
+  int ret = -1;
+
+  evsig_lock(&s->master_mutex);
+  {
+    if (s->eventfd == -1) {
+      s->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+      // The send path sets the flag before taking the lock, so if we don't
+      // see it here the sender will see our fd once we unlock.
+      if (s->eventfd != -1 && atomic_load(&s->shutdown))
+        (void)eventfd_write(s->eventfd, 1);
+    }
+
+    ret = s->eventfd;
+  }
+  evsig_unlock(&s->master_mutex);
+
+  return ret;
+}
+
+void evsig_thread_shutdown_signal_close_eventfd(evsig_thread_shutdown_signal* s) {
+  evsig_lock(&s->master_mutex);
+  {
+    if (s->eventfd != -1) close(s->eventfd);
+    s->eventfd = -1;
+  }
+  evsig_unlock(&s->master_mutex);
 }
 
 void evsig_thread_shutdown_signal_send_async(evsig_thread_shutdown_signal* s,
                                              bool     exit_process) {
+  if (exit_process) atomic_store(&unwind_fast_exit, true);
+
   evsig_lock(&s->master_mutex);
   s->shutdown_thread_exit = exit_process;
   evsig_unlock(&s->shutdown_mutex);
   evsig_unlock(&s->master_mutex);
 }
+
+void evsig_thread_shutdown_signal_set_timeout(evsig_thread_shutdown_signal* s,
+                                              uint64_t timeout_ms) {
+  evsig_lock(&s->master_mutex);
+  s->timeout_ms = timeout_ms;
+  evsig_unlock(&s->master_mutex);
+}
+
+void evsig_thread_shutdown_signal_remove_child(evsig_thread_shutdown_signal* parent,
+                                               evsig_thread_shutdown_signal* child) {
+  evsig_lock(&parent->master_mutex);
+  {
+    // Shift child out, keeping phase order
+    uint64_t shift = 0;
+    for (uint64_t i = 0; i < parent->children_fill; i++) {
+      while (i+shift < parent->children_fill && parent->children[i+shift] == child)
+        shift++;
+
+      if (shift && i+shift < parent->children_fill)
+        parent->children[i] = parent->children[i+shift];
+    }
+    parent->children_fill -= shift;
+
+    if (shift) {
+      evsig_lock(&child->master_mutex);
+      child->parent = NULL;
+      evsig_unlock(&child->master_mutex);
+    }
+
+    // Free children list if empty
+    if (!parent->children_fill) {
+      free(parent->children);
+      parent->children       = NULL;
+      parent->children_alloc = 0;
+    }
+  }
+  evsig_unlock(&parent->master_mutex);
+}
+
+bool evsig_thread_shutdown_signal_add_child(evsig_thread_shutdown_signal* parent,
+                                            evsig_thread_shutdown_signal* child,
+                                            uint32_t phase) {
+  // Sending would recurse forever if child is parent or one of its ancestors
+  for (evsig_thread_shutdown_signal* a = parent; a;) {
+    if (a == child) return false;
+
+    evsig_lock(&a->master_mutex);
+    evsig_thread_shutdown_signal* next = a->parent;
+    evsig_unlock(&a->master_mutex);
+    a = next;
+  }
+
+  evsig_lock(&child->master_mutex);
+  evsig_thread_shutdown_signal* old_parent = child->parent;
+  evsig_unlock(&child->master_mutex);
+
+  if (old_parent) evsig_thread_shutdown_signal_remove_child(old_parent, child);
+
+  evsig_lock(&parent->master_mutex);
+  {
+    // Grow children list if needed
+    if (parent->children_fill >= parent->children_alloc) {
+      if (!parent->children_alloc) parent->children_alloc  = 4;
+      else                         parent->children_alloc *= 2;
+
+      parent->children =
+        realloc(parent->children,
+                sizeof(evsig_thread_shutdown_signal*)*parent->children_alloc);
+
+      if (!parent->children) {
+        fprintf(stderr, "Failed to (re)allocate children list for libevsig "
+                        "shutdown signal");
+        exit(1);
+      }
+    }
+
+    evsig_lock(&child->master_mutex);
+    child->parent = parent;
+    child->phase  = phase;
+    evsig_unlock(&child->master_mutex);
+
+    // Insert after every child with a phase <= ours
+    uint64_t at = parent->children_fill;
+    while (at > 0 && parent->children[at-1]->phase > phase) {
+      parent->children[at] = parent->children[at-1];
+      at--;
+    }
+    parent->children[at] = child;
+    parent->children_fill++;
+  }
+  evsig_unlock(&parent->master_mutex);
+  return true;
+}
+
+static int _timing_cmp(const void* a, const void* b) {
+  const evsig_thread_shutdown_timing* ea = a;
+  const evsig_thread_shutdown_timing* eb = b;
+
+  // Never confirmed first
+  if (!ea->confirmed_us != !eb->confirmed_us) return ea->confirmed_us ? 1 : -1;
+  if (!ea->confirmed_us) return 0;
+
+  uint64_t da = ea->confirmed_us - ea->notified_us;
+  uint64_t db = eb->confirmed_us - eb->notified_us;
+  return (da < db) - (da > db);
+}
+
+void evsig_thread_shutdown_report_sort(evsig_thread_shutdown_report* report) {
+  if (report->fill) qsort(report->entries, report->fill,
+                          sizeof(evsig_thread_shutdown_timing), _timing_cmp);
+}
+
+void evsig_thread_shutdown_report_print(const evsig_thread_shutdown_report* report,
+                                        int      fd,
+                                        uint64_t max_entries) {
+  char line[256];
+  int  len;
+
+  uint64_t n = report->fill;
+  if (max_entries && max_entries < n) n = max_entries;
+
+  len = snprintf(line, sizeof(line),
+                 "[libevsig] Shutdown report (%" PRIu64 " threads):\n"
+                 "  %-8s  %-16s  %-18s  %s\n",
+                 report->fill, "TID", "Name", "Group", "Time to confirm");
+  (void)write(fd, line, len);
+
+  for (uint64_t i = 0; i < n; i++) {
+    const evsig_thread_shutdown_timing* e = report->entries+i;
+
+    char took[64];
+    if (!e->confirmed_us)
+      snprintf(took, sizeof(took), "never confirmed");
+    else if (e->exited)
+      snprintf(took, sizeof(took), "exited without confirming (found after %" PRIu64 " ms)",
+               (e->confirmed_us - e->notified_us)/1000);
+    else
+      snprintf(took, sizeof(took), "%" PRIu64 ".%03" PRIu64 " ms",
+               (e->confirmed_us - e->notified_us)/1000,
+               (e->confirmed_us - e->notified_us)%1000);
+
+    len = snprintf(line, sizeof(line), "  %-8d  %-16s  %-18p  %s\n",
+                   e->tid, e->name[0] ? e->name : "???", e->group, took);
+    (void)write(fd, line, len);
+  }
+}
+
+void evsig_thread_shutdown_report_free(evsig_thread_shutdown_report* report) {
+  free(report->entries);
+  report->entries = NULL;
+  report->fill    = 0;
+  report->alloc   = 0;
+}
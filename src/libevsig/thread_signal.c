@@ -0,0 +1,754 @@
+#define _GNU_SOURCE // Needed for gettid() and tgkill()
+#include "libevsig/thread_signal.h"
+#include "libevsig/signals.h"
+#include "libevsig/errno_signals.h"
+#include "libevsig/evsig_mutex.h"
+#include "libevsig/unwind.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include "libevsig/util.h"
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+
+thread_local evsig_thread_ctl evsig_self;
+
+SIG_DEFTYPE(SIG_RESTART_HANDLED);
+
+// Every thread that has called sig_init
+static evsig_thread_ctl** registry       = NULL;
+static uint64_t           registry_fill  = 0;
+static uint64_t           registry_alloc = 0;
+static evsig_mutex        registry_mutex = 0;
+
+// The same threads by tid, chained through tid_next. Protected by
+// registry_mutex.
+#define TID_BUCKETS 256
+static evsig_thread_ctl* tid_buckets[TID_BUCKETS];
+
+static pthread_once_t sigusr2_once = PTHREAD_ONCE_INIT;
+static pthread_once_t atfork_once  = PTHREAD_ONCE_INIT;
+
+// Unregisters threads that exit without sig_cleanup, so the registry,
+// watchdog and tid lookups never see a dead thread's evsig_self
+static pthread_key_t  register_key;
+static pthread_once_t register_key_once = PTHREAD_ONCE_INIT;
+
+// Broadcast subscribers, changed under the registry lock. Publishers read a
+// snapshot instead: there are two copies, and bus_gen's parity picks the
+// current one. A publisher pins it with one increment of the matching
+// bus_readers, so a publish costs two shared RMWs however many subscribers
+// there are. Changing subscribers rewrites the other copy, flips bus_gen,
+// then waits out readers of the old copy, so a leaving subscriber's ring is
+// safe to free and the old copy to reuse.
+typedef struct {
+  uint64_t          fill;
+  evsig_thread_ctl* subs[EVSIG_BUS_MAX_SUBSCRIBERS];
+} _bus_snapshot;
+
+static evsig_thread_ctl* bus_subs[EVSIG_BUS_MAX_SUBSCRIBERS];
+static uint64_t          bus_subs_fill = 0;
+
+static _bus_snapshot    bus_snaps[2];
+static _Atomic uint64_t bus_readers[2];
+static _Atomic uint64_t bus_gen = 0;
+
+// Watchdog monitor thread, started on first watch. Cleared in a forked
+// child, where the thread wasn't copied.
+static _Atomic bool     watchdog_running            = false;
+static _Atomic bool     watchdog_restart_after_fork = false;
+static _Atomic uint64_t watchdog_tick_ms            = 100;
+
+// Only here to interrupt blocking syscalls. The signal to handle is
+// already pending by the time this runs.
+static void _sighandle_kick(int sig) {}
+
+static void _install_sigusr2() {
+  struct sigaction sa;
+  sa.sa_handler = _sighandle_kick;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0; // No SA_RESTART, we want EINTR
+
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+// Keep the registry lock across fork() so the child doesn't inherit it held
+static void _atfork_prepare() { evsig_lock(&registry_mutex); }
+static void _atfork_parent()  { evsig_unlock(&registry_mutex); }
+
+static void _atfork_child() {
+  // Only the forking thread exists in the child, under a new tid
+  uint64_t fill = 0;
+  for (uint64_t i = 0; i < registry_fill; i++)
+    if (registry[i] == &evsig_self) registry[fill++] = &evsig_self;
+  registry_fill = fill;
+
+  memset(tid_buckets, 0, sizeof(tid_buckets));
+  if (fill) {
+    evsig_self.tid = gettid();
+    atomic_store(&evsig_self.refs, 0);
+    evsig_self.tid_next = NULL;
+    tid_buckets[evsig_self.tid % TID_BUCKETS] = &evsig_self;
+  }
+
+  // Publishers in other threads were mid-publish, and are gone
+  bus_subs_fill = 0;
+  if (evsig_self.bus_ring) {
+    evsig_self.bus_slot = 0;
+    bus_subs[bus_subs_fill++] = &evsig_self;
+  }
+  atomic_store(&bus_gen, 0);
+  atomic_store(&bus_readers[0], 0);
+  atomic_store(&bus_readers[1], 0);
+  bus_snaps[0].fill = bus_subs_fill;
+  memcpy(bus_snaps[0].subs, bus_subs, sizeof(evsig_thread_ctl*)*bus_subs_fill);
+
+  // The watchdog thread wasn't forked. Creating threads here isn't safe if
+  // the parent was multithreaded, so it's restarted by the child's next
+  // call into this API (see _evsig_watchdog_restart_after_fork).
+  if (atomic_exchange(&watchdog_running, false))
+    atomic_store(&watchdog_restart_after_fork, true);
+
+  registry_mutex = 0;
+}
+
+static void _install_atfork() {
+  pthread_atfork(_atfork_prepare, _atfork_parent, _atfork_child);
+}
+
+// pthread key destructor, runs when a registered thread exits
+static void _unregister_on_thread_exit(void* ud) {
+  _sig_thread_unregister();
+}
+
+static void _create_register_key() {
+  if (pthread_key_create(&register_key, _unregister_on_thread_exit) != 0) {
+    fprintf(stderr, "Failed to create thread exit key for libevsig thread registry");
+    exit(1);
+  }
+}
+
+void _sig_thread_register() {
+  pthread_once(&sigusr2_once, _install_sigusr2);
+  pthread_once(&atfork_once,  _install_atfork);
+  pthread_once(&register_key_once, _create_register_key);
+  _evsig_watchdog_restart_after_fork();
+
+  evsig_self.tid = gettid();
+  atomic_store(&evsig_self.pending_sig, NULL);
+  evsig_self.pending_mutex = 0;
+  evsig_self.watchdog_deadline_ms = 0;
+  atomic_store(&evsig_self.posted, NULL);
+  evsig_self.posted_inflight = NULL;
+  evsig_self.wake_fd         = -1;
+  evsig_self.bus_ring        = NULL;
+  evsig_self.bus_slot        = -1;
+  atomic_store(&evsig_self.refs, 0);
+
+  evsig_lock(&registry_mutex);
+  {
+    // Grow registry if needed
+    if (registry_fill >= registry_alloc) {
+      if (!registry_alloc) registry_alloc  = 16;
+      else                 registry_alloc *= 2;
+
+      registry = realloc(registry, sizeof(evsig_thread_ctl*)*registry_alloc);
+      if (!registry) {
+        fprintf(stderr, "Failed to (re)allocate libevsig thread registry\n");
+        exit(1);
+      }
+    }
+
+    registry[registry_fill++] = &evsig_self;
+
+    evsig_thread_ctl** b = &tid_buckets[evsig_self.tid % TID_BUCKETS];
+    evsig_self.tid_next = *b;
+    *b = &evsig_self;
+  }
+  evsig_unlock(&registry_mutex);
+
+  pthread_setspecific(register_key, &evsig_self);
+}
+
+// Finds tid's ctl and takes a reference, so it stays registered until
+// _ctl_unref without holding the lock
+static evsig_thread_ctl* _ctl_ref(pid_t tid) {
+  evsig_lock(&registry_mutex);
+  evsig_thread_ctl* c = tid_buckets[tid % TID_BUCKETS];
+  while (c && c->tid != tid) c = c->tid_next;
+  if (c) atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+  evsig_unlock(&registry_mutex);
+
+  return c;
+}
+
+static void _ctl_unref(evsig_thread_ctl* c) {
+  atomic_fetch_sub_explicit(&c->refs, 1, memory_order_release);
+}
+
+static void _bus_leave();
+static bool _bus_ring_peek(evsig_bus_ring* r);
+static evsig_sig_payload* _bus_ring_pop(evsig_bus_ring* r);
+
+void _sig_thread_unregister() {
+  pthread_setspecific(register_key, NULL);
+  _bus_leave();
+
+  evsig_lock(&registry_mutex);
+  {
+    for (uint64_t i = 0; i < registry_fill; i++) {
+      if (registry[i] == &evsig_self) {
+        registry[i] = registry[--registry_fill];
+        break;
+      }
+    }
+
+    evsig_thread_ctl** b = &tid_buckets[evsig_self.tid % TID_BUCKETS];
+    while (*b && *b != &evsig_self) b = &(*b)->tid_next;
+    if (*b) *b = evsig_self.tid_next;
+
+    if (!registry_fill) {
+      free(registry);
+      registry       = NULL;
+      registry_alloc = 0;
+    }
+  }
+  evsig_unlock(&registry_mutex);
+
+  // Wait out anyone who found us before we left
+  while (atomic_load_explicit(&evsig_self.refs, memory_order_acquire))
+    __builtin_ia32_pause();
+
+  // Nobody can post to us anymore, discard whatever is left
+  evsig_posted_sig* lists[2] = { atomic_exchange(&evsig_self.posted, NULL),
+                                 evsig_self.posted_inflight };
+  for (int i = 0; i < 2; i++) {
+    evsig_posted_sig* e = lists[i];
+    while (e) {
+      evsig_posted_sig* next = e->next;
+      _sig_payload_unref(e->payload);
+      free(e);
+      e = next;
+    }
+  }
+  evsig_self.posted_inflight = NULL;
+
+  if (evsig_self.wake_fd != -1) close(evsig_self.wake_fd);
+  evsig_self.wake_fd = -1;
+}
+
+evsig_sig_payload* _sig_payload_new(const char* sig_type,
+                                    const char* msg,
+                                    void* signal_data,
+                                    void (*signal_data_cleanup_func)(void*)) {
+  evsig_sig_payload* p = malloc(sizeof(evsig_sig_payload));
+  char* msg_copy = strdup(msg ? msg : "");
+  if (!p || !msg_copy) {
+    fprintf(stderr, "Failed to allocate libevsig posted signal\n");
+    exit(1);
+  }
+
+  atomic_store_explicit(&p->refs, 1, memory_order_relaxed);
+  p->sig_type                 = sig_type;
+  p->msg                      = msg_copy;
+  p->signal_data              = signal_data;
+  p->signal_data_cleanup_func = signal_data_cleanup_func;
+
+  return p;
+}
+
+void _sig_payload_unref(evsig_sig_payload* p) {
+  if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) != 1) return;
+
+  if (p->signal_data_cleanup_func) p->signal_data_cleanup_func(p->signal_data);
+  free(p->msg);
+  free(p);
+}
+
+static void _unwind_handler_payload_unref(void* p) { _sig_payload_unref(p); }
+
+// Call holding a reference to c. Takes over the caller's reference to p and
+// e, which must already be allocated: nothing here allocates.
+static void _push_posted(evsig_thread_ctl* c, evsig_posted_sig* e, evsig_sig_payload* p) {
+  e->payload = p;
+
+  // seq_cst, pairing with sig_post_eventfd: either it sees our push or we
+  // see its fd
+  evsig_posted_sig* head = atomic_load_explicit(&c->posted, memory_order_relaxed);
+  do {
+    e->next = head;
+  } while (!atomic_compare_exchange_weak(&c->posted, &head, e));
+
+  // Only the post that makes the queue non-empty needs to wake the thread
+  int fd = atomic_load(&c->wake_fd);
+  if (!head && fd != -1) (void)eventfd_write(fd, 1);
+}
+
+bool sig_post(pid_t tid,
+              const char* sig_type,
+              const char* msg,
+              void* signal_data,
+              void (*signal_data_cleanup_func)(void*)) {
+  _evsig_watchdog_restart_after_fork();
+
+  // Allocate before looking the target up, so no lock is held across malloc
+  evsig_sig_payload* p = _sig_payload_new(sig_type, msg, signal_data,
+                                          signal_data_cleanup_func);
+  evsig_posted_sig*  e = malloc(sizeof(evsig_posted_sig));
+  if (!e) {
+    fprintf(stderr, "Failed to allocate libevsig posted signal\n");
+    exit(1);
+  }
+
+  evsig_thread_ctl* c = _ctl_ref(tid);
+  if (!c) {
+    free(e);
+    _sig_payload_unref(p); // Runs signal_data_cleanup_func
+    return false;
+  }
+
+  _push_posted(c, e, p);
+  _ctl_unref(c);
+
+  return true;
+}
+
+// Runs however sig_poll exits. If a handler unwound out of it, whatever it
+// didn't get to still needs a wakeup, or an event loop waiting on the eventfd
+// would never come back for it.
+static void _unwind_handler_poll_rearm(void* ud) {
+  bool more = evsig_self.posted_inflight || atomic_load(&evsig_self.posted);
+
+  if (evsig_self.bus_ring && _bus_ring_peek(evsig_self.bus_ring)) {
+    atomic_store(&evsig_self.bus_pending, true);
+    more = true;
+  }
+
+  int fd = atomic_load(&evsig_self.wake_fd);
+  if (more && fd != -1) (void)eventfd_write(fd, 1);
+}
+
+uint64_t sig_poll() {
+  uint64_t n = 0;
+
+  _evsig_watchdog_restart_after_fork();
+
+  // Re-arm the wakeup before taking the queue, so a post that lands after
+  // the exchange still wakes us
+  if (evsig_self.wake_fd != -1) {
+    eventfd_t v;
+    (void)eventfd_read(evsig_self.wake_fd, &v);
+  }
+
+  UNWIND_ACTION(_unwind_handler_poll_rearm, NULL);
+
+  evsig_posted_sig* head = atomic_exchange_explicit(&evsig_self.posted, NULL,
+                                                    memory_order_acquire);
+
+  // Reverse to oldest first and append to whatever a previous, unwound
+  // sig_poll didn't get to
+  evsig_posted_sig* fifo = NULL;
+  while (head) {
+    evsig_posted_sig* next = head->next;
+    head->next = fifo;
+    fifo = head;
+    head = next;
+  }
+
+  evsig_posted_sig** tail = &evsig_self.posted_inflight;
+  while (*tail) tail = &(*tail)->next;
+  *tail = fifo;
+
+  while (evsig_self.posted_inflight) {
+    evsig_posted_sig* e = evsig_self.posted_inflight;
+    evsig_self.posted_inflight = e->next;
+
+    evsig_sig_payload* p = e->payload;
+    free(e);
+    n++;
+
+    UNWIND_ACTION(_unwind_handler_payload_unref, p);
+    SIG_AUTOPOP_RESTART(p->sig_type, SIG_RESTART_HANDLED, ({ continue; }));
+    SIG_SEND(p->sig_type, p->msg, p->signal_data, NULL);
+  }
+
+  if (evsig_self.bus_ring) {
+    // Re-arm before draining, for the same reason as the eventfd above
+    atomic_store(&evsig_self.bus_pending, false);
+
+    evsig_sig_payload* p;
+    while ((p = _bus_ring_pop(evsig_self.bus_ring))) {
+      n++;
+
+      UNWIND_ACTION(_unwind_handler_payload_unref, p);
+      SIG_AUTOPOP_RESTART(p->sig_type, SIG_RESTART_HANDLED, ({ continue; }));
+      SIG_SEND(p->sig_type, p->msg, p->signal_data, NULL);
+    }
+  }
+
+  return n;
+}
+
+static bool _bus_ring_push(evsig_bus_ring* r, evsig_sig_payload* p) {
+  uint64_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+
+  while (true) {
+    evsig_bus_cell* cell = r->cells + (pos & (EVSIG_BUS_RING_SIZE-1));
+    uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    int64_t  dif = (int64_t)seq - (int64_t)pos;
+
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&r->enqueue_pos, &pos, pos+1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->payload = p;
+        atomic_store_explicit(&cell->seq, pos+1, memory_order_release);
+        return true;
+      }
+    } else if (dif < 0) {
+      atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+      return false;
+    } else {
+      pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+// Subscriber only
+static bool _bus_ring_peek(evsig_bus_ring* r) {
+  evsig_bus_cell* cell = r->cells + (r->dequeue_pos & (EVSIG_BUS_RING_SIZE-1));
+  return atomic_load_explicit(&cell->seq, memory_order_acquire) == r->dequeue_pos+1;
+}
+
+// Subscriber only
+static evsig_sig_payload* _bus_ring_pop(evsig_bus_ring* r) {
+  evsig_bus_cell* cell = r->cells + (r->dequeue_pos & (EVSIG_BUS_RING_SIZE-1));
+  uint64_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+  if (seq != r->dequeue_pos+1) return NULL;
+
+  evsig_sig_payload* p = cell->payload;
+  atomic_store_explicit(&cell->seq, r->dequeue_pos+EVSIG_BUS_RING_SIZE,
+                        memory_order_release);
+  r->dequeue_pos++;
+
+  return p;
+}
+
+static bool _bus_wants(evsig_thread_ctl* c, const char* sig_type) {
+  for (int i = 0; i < EVSIG_BUS_MAX_TYPES; i++) {
+    const char* t = atomic_load_explicit(&c->bus_types[i], memory_order_relaxed);
+    if (t == sig_type || t == SIGNAL_ALL) return true;
+  }
+  return false;
+}
+
+// Call with registry_mutex held, after changing bus_subs
+static void _bus_publish_subs() {
+  uint64_t g = atomic_load(&bus_gen);
+
+  // Nobody reads the other copy: readers of it drained when it was replaced,
+  // and later ones see bus_gen moved on before reading
+  _bus_snapshot* next = &bus_snaps[(g+1) & 1];
+  next->fill = bus_subs_fill;
+  memcpy(next->subs, bus_subs, sizeof(evsig_thread_ctl*)*bus_subs_fill);
+  atomic_store(&bus_gen, g+1);
+
+  while (atomic_load(&bus_readers[g & 1])) __builtin_ia32_pause();
+}
+
+// Pins the current subscriber snapshot until _bus_unpin(gen)
+static _bus_snapshot* _bus_pin(uint64_t* gen) {
+  while (true) {
+    uint64_t g = atomic_load(&bus_gen);
+    atomic_fetch_add(&bus_readers[g & 1], 1);
+
+    // Otherwise a writer may be rewriting that copy
+    if (atomic_load(&bus_gen) == g) {
+      *gen = g;
+      return &bus_snaps[g & 1];
+    }
+
+    atomic_fetch_sub(&bus_readers[g & 1], 1);
+  }
+}
+
+static void _bus_unpin(uint64_t gen) {
+  atomic_fetch_sub(&bus_readers[gen & 1], 1);
+}
+
+static bool _bus_join() {
+  if (evsig_self.bus_ring) return true;
+
+  evsig_bus_ring* r = malloc(sizeof(evsig_bus_ring));
+  if (!r) {
+    fprintf(stderr, "Failed to allocate libevsig broadcast ring\n");
+    exit(1);
+  }
+  atomic_store(&r->enqueue_pos, 0);
+  atomic_store(&r->dropped, 0);
+  r->dequeue_pos = 0;
+  for (uint64_t i = 0; i < EVSIG_BUS_RING_SIZE; i++) atomic_store(&r->cells[i].seq, i);
+
+  evsig_self.bus_ring = r;
+  atomic_store(&evsig_self.bus_pending, false);
+  for (int i = 0; i < EVSIG_BUS_MAX_TYPES; i++) atomic_store(&evsig_self.bus_types[i], NULL);
+
+  bool joined = false;
+  evsig_lock(&registry_mutex);
+  if (bus_subs_fill < EVSIG_BUS_MAX_SUBSCRIBERS) {
+    evsig_self.bus_slot = bus_subs_fill;
+    bus_subs[bus_subs_fill++] = &evsig_self;
+    _bus_publish_subs();
+    joined = true;
+  }
+  evsig_unlock(&registry_mutex);
+
+  if (!joined) {
+    free(r);
+    evsig_self.bus_ring = NULL;
+  }
+
+  return joined;
+}
+
+static void _bus_leave() {
+  if (!evsig_self.bus_ring) return;
+
+  evsig_lock(&registry_mutex);
+  evsig_thread_ctl* last = bus_subs[--bus_subs_fill];
+  bus_subs[evsig_self.bus_slot] = last;
+  last->bus_slot = evsig_self.bus_slot;
+  evsig_self.bus_slot = -1;
+  _bus_publish_subs();
+  evsig_unlock(&registry_mutex);
+
+  evsig_sig_payload* p;
+  while ((p = _bus_ring_pop(evsig_self.bus_ring))) _sig_payload_unref(p);
+  free(evsig_self.bus_ring);
+  evsig_self.bus_ring = NULL;
+}
+
+bool sig_subscribe(const char* sig_type) {
+  if (!_bus_join()) return false;
+
+  int free_i = -1;
+  for (int i = 0; i < EVSIG_BUS_MAX_TYPES; i++) {
+    const char* t = atomic_load(&evsig_self.bus_types[i]);
+    if (t == sig_type) return true;
+    if (!t && free_i < 0) free_i = i;
+  }
+  if (free_i < 0) return false;
+
+  atomic_store(&evsig_self.bus_types[free_i], sig_type);
+  return true;
+}
+
+void sig_unsubscribe(const char* sig_type) {
+  if (!evsig_self.bus_ring) return;
+
+  bool any = false;
+  for (int i = 0; i < EVSIG_BUS_MAX_TYPES; i++) {
+    if (atomic_load(&evsig_self.bus_types[i]) == sig_type)
+      atomic_store(&evsig_self.bus_types[i], NULL);
+    if (atomic_load(&evsig_self.bus_types[i])) any = true;
+  }
+
+  if (!any) _bus_leave();
+}
+
+uint64_t sig_broadcast(const char* sig_type,
+                       const char* msg,
+                       void* signal_data,
+                       void (*signal_data_cleanup_func)(void*)) {
+  uint64_t n = 0;
+
+  // We hold one reference while publishing, so subscribers that finish
+  // early can't free the payload under us
+  evsig_sig_payload* p = _sig_payload_new(sig_type, msg, signal_data,
+                                          signal_data_cleanup_func);
+
+  uint64_t gen;
+  _bus_snapshot* snap = _bus_pin(&gen);
+  for (uint64_t i = 0; i < snap->fill; i++) {
+    evsig_thread_ctl* c = snap->subs[i];
+    if (_bus_wants(c, sig_type)) {
+      atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+
+      if (_bus_ring_push(c->bus_ring, p)) {
+        n++;
+        if (!atomic_exchange(&c->bus_pending, true) && c->wake_fd != -1)
+          (void)eventfd_write(c->wake_fd, 1);
+      } else {
+        atomic_fetch_sub_explicit(&p->refs, 1, memory_order_relaxed);
+      }
+    }
+  }
+  _bus_unpin(gen);
+
+  _sig_payload_unref(p);
+  return n;
+}
+
+int sig_post_eventfd() {
+  // Only we write our fd. Posters read it without a lock: the seq_cst store
+  // and the load of posted below pair with _push_posted.
+  if (evsig_self.wake_fd == -1) {
+    evsig_self.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    // Anything already queued wouldn't otherwise wake us
+    if (evsig_self.wake_fd != -1
+        && (atomic_load(&evsig_self.posted) || evsig_self.posted_inflight
+            || atomic_load(&evsig_self.bus_pending)))
+      (void)eventfd_write(evsig_self.wake_fd, 1);
+  }
+
+  return evsig_self.wake_fd;
+}
+
+// Call with registry_mutex held or a reference to c, so c can't go away under
+// us
+static bool _post_pending(evsig_thread_ctl* c, const char* sig_type, const char* msg) {
+  bool ret = false;
+
+  evsig_lock(&c->pending_mutex);
+  if (!atomic_load(&c->pending_sig)) {
+    snprintf(c->pending_msg, sizeof(c->pending_msg), "%s", msg ? msg : "");
+    atomic_store_explicit(&c->pending_sig, sig_type, memory_order_release);
+    ret = true;
+  }
+  evsig_unlock(&c->pending_mutex);
+
+  if (ret) (void)tgkill(getpid(), c->tid, SIGUSR2);
+  return ret;
+}
+
+bool evsig_unwind_thread(pid_t tid, const char* sig_type, const char* msg) {
+  bool ret = false;
+
+  _evsig_watchdog_restart_after_fork();
+
+  evsig_thread_ctl* c = _ctl_ref(tid);
+  if (c) {
+    ret = _post_pending(c, sig_type, msg);
+    _ctl_unref(c);
+  }
+
+  return ret;
+}
+
+bool evsig_cancel_thread(pid_t tid) {
+  return evsig_unwind_thread(tid, SIGNAL_ECANCELED, "Thread cancelled");
+}
+
+static void* _watchdog_thread(void* ud) {
+  // Leave OS signals to the threads that asked for them
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  while (true) {
+    evsig_sleep_ns(atomic_load(&watchdog_tick_ms)*1000000);
+    uint64_t now = evsig_time_ms();
+
+    // Recomputed from the live entries every pass, so the tick relaxes again
+    // once a short deadline stops being watched
+    uint64_t tick = 100;
+
+    evsig_lock(&registry_mutex);
+    for (uint64_t i = 0; i < registry_fill; i++) {
+      evsig_thread_ctl* c = registry[i];
+      if (!c->watchdog_deadline_ms) continue;
+
+      uint64_t c_tick = c->watchdog_deadline_ms/4;
+      if (c_tick < 1)    c_tick = 1;
+      if (c_tick < tick) tick   = c_tick;
+
+      uint64_t beat = atomic_load_explicit(&c->heartbeat, memory_order_relaxed);
+      if (beat != c->watchdog_last_beat
+          || atomic_load_explicit(&c->watchdog_paused, memory_order_relaxed)) {
+        c->watchdog_last_beat      = beat;
+        c->watchdog_last_change_ms = now;
+        continue;
+      }
+
+      if (now - c->watchdog_last_change_ms < c->watchdog_deadline_ms) continue;
+
+      char msg[128];
+      snprintf(msg, sizeof(msg), "Watchdog: no heartbeat from thread %d for %" PRIu64 " ms",
+               c->tid, now - c->watchdog_last_change_ms);
+      _post_pending(c, c->watchdog_sig, msg);
+
+      // Give the thread another full deadline to recover
+      c->watchdog_last_change_ms = now;
+    }
+    atomic_store(&watchdog_tick_ms, tick);
+    evsig_unlock(&registry_mutex);
+  }
+
+  return NULL;
+}
+
+static void _watchdog_start_if_needed() {
+  if (atomic_load(&watchdog_running) || atomic_exchange(&watchdog_running, true)) return;
+
+  pthread_t t;
+  int r = pthread_create(&t, NULL, _watchdog_thread, NULL);
+  if (r != 0) {
+    fprintf(stderr, "Failed to create libevsig watchdog thread\n");
+    exit(1);
+  }
+  pthread_detach(t); // So we don't need to join it
+}
+
+void _evsig_watchdog_restart_after_fork() {
+  if (__builtin_expect(!atomic_load_explicit(&watchdog_restart_after_fork,
+                                             memory_order_relaxed), 1)
+      || !atomic_exchange(&watchdog_restart_after_fork, false))
+    return;
+
+  // Only restart if the forking thread is still being watched
+  evsig_lock(&registry_mutex);
+  bool watched = false;
+  for (uint64_t i = 0; i < registry_fill; i++)
+    if (registry[i]->watchdog_deadline_ms) watched = true;
+  evsig_unlock(&registry_mutex);
+
+  if (watched) _watchdog_start_if_needed();
+}
+
+void evsig_watchdog_watch(uint64_t deadline_ms, const char* sig_type) {
+  if (deadline_ms) _watchdog_start_if_needed();
+
+  evsig_lock(&registry_mutex);
+  {
+    evsig_self.watchdog_deadline_ms    = deadline_ms;
+    evsig_self.watchdog_sig            = sig_type;
+    evsig_self.watchdog_last_beat      = atomic_load(&evsig_self.heartbeat);
+    evsig_self.watchdog_last_change_ms = evsig_time_ms();
+
+    // Don't wait out a longer tick before the new deadline is honoured. The
+    // watchdog thread raises it again once this entry goes away.
+    if (deadline_ms) {
+      uint64_t tick = deadline_ms/4;
+      if (tick < 1) tick = 1;
+      if (tick < atomic_load(&watchdog_tick_ms)) atomic_store(&watchdog_tick_ms, tick);
+    }
+  }
+  evsig_unlock(&registry_mutex);
+}
+
+void _sig_deliver_pending() {
+  char msg[EVSIG_PENDING_MSG_MAX];
+
+  evsig_lock(&evsig_self.pending_mutex);
+  const char* sig_type = atomic_load_explicit(&evsig_self.pending_sig,
+                                              memory_order_acquire);
+  memcpy(msg, evsig_self.pending_msg, sizeof(msg));
+  atomic_store(&evsig_self.pending_sig, NULL);
+  evsig_unlock(&evsig_self.pending_mutex);
+
+  if (sig_type) SIG_SEND(sig_type, msg, NULL, NULL);
+}
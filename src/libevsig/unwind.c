@@ -9,6 +9,7 @@
 #include "threads.h"
 #include <signal.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include "libevsig/evsig_mutex.h"
 #include "libevsig/thread_shutdown_signal.h"
@@ -21,6 +22,15 @@
 thread_local unwind_handler_stack_entry* unwind_stack;
 thread_local uint64_t unwind_stack_alloc;
 thread_local uint64_t unwind_stack_fill;
+
+// Kind and class of each unwind_stack entry, kept apart so entries stay two
+// words. Grown with unwind_stack.
+typedef struct {
+  uint8_t kind;
+  uint8_t cls;
+} _entry_meta;
+
+static thread_local _entry_meta* unwind_stack_meta;
 thread_local int64_t  unwind_init_ref = 0;
 
 // For signal-handler-safe printing
@@ -35,6 +45,43 @@ static void _print(char* msg) {
   (void)write(STDERR_FILENO, msg, len);
 }
 
+_Atomic bool unwind_fast_exit = false;
+
+// UNWIND_CLASS_FD fds skipped on fast exit, closed together by
+// _flush_deferred_closes
+#define DEFERRED_CLOSES_MAX 256
+static thread_local void*    deferred_closes[DEFERRED_CLOSES_MAX];
+static thread_local uint64_t deferred_closes_fill = 0;
+
+static void _flush_deferred_closes() {
+  if (!deferred_closes_fill) return;
+  unwind_batch_handler_close(deferred_closes, deferred_closes_fill);
+  deferred_closes_fill = 0;
+}
+
+// unwinding is true when running a run of entries that ends in
+// _flush_deferred_closes. Fast-exit shortcuts only apply then: an entry run
+// on normal scope exit is run as usual, so a thread still working during
+// shutdown doesn't leave fds open behind it.
+static inline void _run_entry(uint64_t i, bool unwinding) {
+  unwind_handler_stack_entry* e = unwind_stack+i;
+  _entry_meta                 m = unwind_stack_meta[i];
+
+  if (m.cls && unwinding && atomic_load_explicit(&unwind_fast_exit, memory_order_relaxed)) {
+    if (m.cls == UNWIND_CLASS_MEMORY) return;
+
+    if (m.cls == UNWIND_CLASS_FD && m.kind == UNWIND_ENTRY_VALUE) {
+      if (deferred_closes_fill == DEFERRED_CLOSES_MAX) _flush_deferred_closes();
+      deferred_closes[deferred_closes_fill++] =
+        (void*)(intptr_t)UNWIND_VALUE_AS(e->value, int);
+      return;
+    }
+  }
+
+  if (m.kind == UNWIND_ENTRY_VALUE) e->vh(e->value);
+  else                              e->h(e->userdata);
+}
+
 // For pthread_cleanup_push/pop
 [[maybe_unused]]
 static void _pthread_mutex_unlock(void* ud) {
@@ -98,16 +145,20 @@ static void _sighandle_dispatch(int sig) {
 }
 
 void unwind_all() {
+  _evsig_thread_shutdown_restart_after_fork();
   evsig_thread_shutdown_signal_send_async(&evsig_global_thread_shutdown_signal,
                                           true);
 }
 
 void unwind_init(bool threadlocal) {
+  _evsig_thread_shutdown_restart_after_fork();
+
   if (unwind_init_ref == 0) {
     unwind_stack_alloc = 32;
     unwind_stack_fill = 0;
-    unwind_stack = malloc(sizeof(unwind_handler_stack_entry)*unwind_stack_alloc);
-    if (!unwind_stack) {
+    unwind_stack      = malloc(sizeof(unwind_handler_stack_entry)*unwind_stack_alloc);
+    unwind_stack_meta = malloc(sizeof(_entry_meta)*unwind_stack_alloc);
+    if (!unwind_stack || !unwind_stack_meta) {
       fprintf(stderr, "Failed to allocate unwind stack\n");
       exit(1);
     }
@@ -146,12 +197,13 @@ void unwind_cleanup() {
 
     // Run all unwind handlers left for this thread
     while (unwind_stack_fill > 0) {
-      unwind_handler_stack_entry* e = unwind_stack+(unwind_stack_fill-1);
-      e->h(e->userdata);
+      _run_entry(unwind_stack_fill-1, true);
       unwind_stack_fill--;
     }
+    _flush_deferred_closes();
 
     free(unwind_stack);
+    free(unwind_stack_meta);
     evsig_thread_shutdown_signal_confirm_shutdown(&evsig_global_thread_shutdown_signal, gettid());
   }
 }
@@ -164,32 +216,63 @@ void _unwind(unwind_return_point* p) {
       // calling the handler in case the handler also chooses
       // to unwind somewhere. This prevents infinite recursion.
       unwind_stack_fill--;
-      unwind_handler_stack_entry* e = unwind_stack+i;
-      e->h(e->userdata);
+      _run_entry(i, true);
     }
+    _flush_deferred_closes();
   }
 
   longjmp(p->jbuf, 1);
 }
 
-void _unwind_action(on_unwind_handler h, void* userdata) {
-
+static void _grow_unwind_stack() {
   if (unwind_stack_fill+1 > unwind_stack_alloc) {
     unwind_stack_alloc *= 2;
     unwind_stack =
       realloc(unwind_stack, sizeof(unwind_handler_stack_entry)*unwind_stack_alloc);
-    if (!unwind_stack) {
+    unwind_stack_meta =
+      realloc(unwind_stack_meta, sizeof(_entry_meta)*unwind_stack_alloc);
+    if (!unwind_stack || !unwind_stack_meta) {
       fprintf(stderr, "Failed to reallocate unwind stack");
       exit(1);
     }
   }
 
-  unwind_handler_stack_entry frame = {.h = h, .userdata = userdata };
-  unwind_stack[unwind_stack_fill++] = frame;
+}
+
+void _unwind_action_class(on_unwind_handler h, void* userdata, uint8_t cls) {
+  _grow_unwind_stack();
+
+  unwind_handler_stack_entry frame = {.h = h, .userdata = userdata};
+  unwind_stack_meta[unwind_stack_fill] = (_entry_meta){ UNWIND_ENTRY_PTR, cls };
+  unwind_stack[unwind_stack_fill++]    = frame;
 
   //sw_fprintf(stderr, "[+] stack size: %ld\n", unwind_stack.element_count);
 }
 
+void _unwind_action(on_unwind_handler h, void* userdata) {
+  uint8_t cls = UNWIND_CLASS_DEFAULT;
+  if (h == unwind_handler_free) cls = UNWIND_CLASS_MEMORY;
+  if (h == unwind_handler_fclose) cls = UNWIND_CLASS_DURABLE;
+  if (h == _unwind_handler_batch
+      && ((unwind_batch*)userdata)->h == unwind_batch_handler_free) cls = UNWIND_CLASS_MEMORY;
+
+  _unwind_action_class(h, userdata, cls);
+}
+
+void _unwind_value_action_class(on_unwind_value_handler h, unwind_value value, uint8_t cls) {
+  _grow_unwind_stack();
+
+  unwind_handler_stack_entry frame = {.vh = h, .value = value};
+  unwind_stack_meta[unwind_stack_fill] = (_entry_meta){ UNWIND_ENTRY_VALUE, cls };
+  unwind_stack[unwind_stack_fill++]    = frame;
+}
+
+void _unwind_value_action(on_unwind_value_handler h, unwind_value value) {
+  _unwind_value_action_class(h, value, h == unwind_value_handler_close
+                                       ? UNWIND_CLASS_FD
+                                       : UNWIND_CLASS_DEFAULT);
+}
+
 void unwind_run_handler(unwind_handler_stack_entry* e) {
   // It is critical to adjust the unwind stack *before*
   // calling the handler in case the handler also chooses
@@ -203,6 +286,16 @@ void unwind_run_handler(unwind_handler_stack_entry* e) {
   //sw_fprintf(stderr, "[-] stack size: %ld\n", unwind_stack.element_count);
 }
 
+// Cleanup for UNWIND_VALUE_ACTION, which keeps no copy of its entry. Scopes
+// exit in stack order, so ours is on top.
+void unwind_run_top_handler(char* unused) {
+  // Already run by unwind_cleanup
+  if (unwind_stack_fill == 0) return;
+
+  unwind_stack_fill--;
+  _run_entry(unwind_stack_fill, false);
+}
+
 void unwind_rm_handler(unwind_handler_stack_entry* e) {
   unwind_stack_fill--;
 
@@ -213,5 +306,75 @@ void unwind_rm_handler(unwind_handler_stack_entry* e) {
 }
 
 void unwind_handler_print(void* ptr) { sw_fprintf(stderr, "%s", ptr); }
-void unwind_handler_free(void* ptr) { free(ptr); }
+void unwind_handler_free(void* ptr) { sw_free(ptr); }
 void unwind_handler_fclose(void* file) { if(file) sw_fclose((FILE*)file); }
+void unwind_value_handler_close(unwind_value fd) { close(UNWIND_VALUE_AS(fd, int)); }
+
+void _unwind_batch_init(unwind_batch* b, on_unwind_batch_handler h) {
+  b->h     = h;
+  b->items = b->inline_items;
+  b->fill  = 0;
+  b->alloc = UNWIND_BATCH_INLINE_ITEMS;
+}
+
+void unwind_batch_add(unwind_batch* b, void* item) {
+  if (b->fill+1 > b->alloc) {
+    b->alloc *= 2;
+
+    void** items;
+    if (b->items == b->inline_items) {
+      items = malloc(sizeof(void*)*b->alloc);
+      if (items) memcpy(items, b->inline_items, sizeof(b->inline_items));
+    } else {
+      items = realloc(b->items, sizeof(void*)*b->alloc);
+    }
+
+    if (!items) {
+      fprintf(stderr, "Failed to grow unwind batch. Exiting.\n");
+      exit(1);
+    }
+    b->items = items;
+  }
+
+  b->items[b->fill++] = item;
+}
+
+void _unwind_handler_batch(void* batch) {
+  unwind_batch* b = batch;
+
+  // Reset first, so the batch is empty if the handler unwinds
+  void**   items = b->items;
+  uint64_t fill  = b->fill;
+  b->fill = 0;
+
+  if (fill) b->h(items, fill);
+  if (items != b->inline_items) free(items);
+  b->items = b->inline_items;
+  b->alloc = UNWIND_BATCH_INLINE_ITEMS;
+}
+
+void unwind_batch_handler_free(void** items, uint64_t count) {
+  for (uint64_t i = 0; i < count; i++) sw_free(items[i]);
+}
+
+static int _cmp_fd(const void* a, const void* b) {
+  intptr_t x = (intptr_t)*(void**)a, y = (intptr_t)*(void**)b;
+  return (x > y) - (x < y);
+}
+
+void unwind_batch_handler_close(void** fds, uint64_t count) {
+  qsort(fds, count, sizeof(void*), _cmp_fd);
+
+  for (uint64_t i = 0; i < count;) {
+    uint64_t j = i;
+    while (j+1 < count && (intptr_t)fds[j+1] <= (intptr_t)fds[j]+1) j++;
+
+    int first = (intptr_t)fds[i];
+    int last  = (intptr_t)fds[j];
+    if (close_range(first, last, 0) == -1) {
+      for (int fd = first; fd <= last; fd++) close(fd);
+    }
+
+    i = j+1;
+  }
+}